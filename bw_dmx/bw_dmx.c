@@ -24,6 +24,7 @@
  * or with the included Makefile (type "make"). 
  */
 
+#define _GNU_SOURCE   // for pthread_setaffinity_np
 
 #include <stdint.h>
 #include <unistd.h>
@@ -35,6 +36,8 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
 
 
 #include <linux/types.h>
@@ -42,23 +45,29 @@
 #include <linux/i2c-dev.h>
 
 #include "dmx.h"
+#include "universe.h"
+#include "patch.h"
+#include "rt.h"
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
 
 
-struct spi_txrx spibuf;
 static enum mode_t dmxmode = DMX_TX;
 
 enum {SPI_MODE = 1, I2C_MODE, USB_I2CMODE, USB_SPIMODE }; 
-static int mode = SPI_MODE;
 
-static const char *device = "/dev/spidev0.0";
 static uint8_t spi_mode;
 static uint8_t bits = 8;
 static uint32_t speed = 6000000;
 static int delay = 0;
-static int wait = 22000;
+static int wait = 0;
+static int realtime = 0;   // SCHED_FIFO priority, 0: not real-time
+
+#define DEFAULT_NCHAN 511  // the board has always been sent 0x200 bytes.
+static int nchan = DEFAULT_NCHAN;
+static int breaktime = 0;  // 0: leave the board at its default.
+static int mab = 0;
 //static int addr = 0x82;
 //static int text = 0;
 //static char *monitor_file;
@@ -75,6 +84,7 @@ static int wait = 22000;
 static int debug = 0;
 #define DEBUG_REGSETTING 0x0001
 #define DEBUG_TRANSFER   0x0002
+#define DEBUG_STATS      0x0004
 
 static void pabort(const char *s)
 {
@@ -220,18 +230,49 @@ static void usb_i2ctxrx (int fd, unsigned char *buf, int tlen, int rlen)
 }
 
 
-static void transfer(int fd, unsigned char *buf, int tlen, int rlen)
+#define MAXUNIV 16
+#define MAXBOARD 8
+
+struct dmx_univ {
+  char *arg;           // file[=patch][:channels[:break[:mab]]] from the command line
+  struct universe *univ;
+  struct patch *patch; // NULL: send the file as it is
+  struct config cfg;
+  uint64_t next;       // when the line will be free for the next frame
+  struct spi_hdr tx, rx;
+  struct univ_tracer trace;
+  int last;            // rx: the frame counter of the last frame
+};
+
+struct board {
+  const char *device;
+  int mode;
+  int fd;
+  int cpu;             // -1: don't pin the thread
+  pthread_t thread;
+  struct spi_txrx spibuf;
+  struct dmx_univ univ[MAXUNIV];
+  int numuniv;
+};
+
+static struct board boards[MAXBOARD];
+static int numboards;
+
+
+static void transfer(struct board *b, unsigned char *buf, int tlen, int rlen)
 {
+  int fd = b->fd;
+
   //printf ("buf=%p.\n", buf);
   if (debug & DEBUG_TRANSFER) 
     dump_buf ("Before tx:", buf, tlen);
-  if (mode == SPI_MODE) 
+  if (b->mode == SPI_MODE) 
     spi_txrx (fd, buf, tlen, rlen);
-  else if (mode == I2C_MODE) 
+  else if (b->mode == I2C_MODE) 
     i2c_txrx (fd, buf, tlen, rlen);
-  else if (mode == USB_SPIMODE)
+  else if (b->mode == USB_SPIMODE)
     usb_spitxrx (fd, buf, tlen, rlen);
-  else if (mode == USB_I2CMODE)
+  else if (b->mode == USB_I2CMODE)
     usb_i2ctxrx (fd, buf, tlen, rlen);
   else 
     pabort ("invalid mode...\n");
@@ -447,21 +488,25 @@ static void do_scan (int fd)
 
 static void print_usage(const char *prog)
 {
-  printf("Usage: %s [-DsbdlHOLC3]\n", prog);
-  puts("  -D --device   device to use (default /dev/spidev1.1)\n"
+  printf("Usage: %s [-DPRsdwribmc] file[=patch][:channels[:break[:mab]]] ...\n"
+         "       %s -D dev file ... [-D dev file ...] ...\n", prog, prog);
+  puts("  With =patch, what is sent is built from other universes according\n"
+       "  to the patch file (see patch.h); file shows what went out.\n");
+  puts("  -D --device   device to use (default /dev/spidev0.0). Files\n"
+       "                that follow go to this board. With more than one\n"
+       "                board, all start their frames in lockstep.\n"
+       "  -P --cpu      pin the thread for the current board to this cpu\n"
+       "  -R --realtime SCHED_FIFO at priority 50 (or --realtime=prio),\n"
+       "                memory locked (see rt.h)\n"
        "  -s --speed    max speed (Hz)\n"
        "  -d --delay    delay (usec)\n"
-       "  -r --rx      \n"
-       "  -v --val      value\n"
-       "  -a --addr     address\n"
-       "  -w --write8   write an octet\n"
-       "  -W --write    write arbitrary type\n"
-       "  -i --interval set the interval\n"
-       "  -S --scan     Scan the bus for devices \n"
-       "  -R --read     multi-datasize read\n"
-       "  -I --i2c      I2C mode (uses /dev/i2c-0, change with -D)\n"
-       "  -U --usb      USB mode (uses /dev/ttyACM0, change with -D)\n"
-       "  -1 --decimal  Numbers are decimal. (registers remain in hex)\n"
+       "  -w --wait     wait between frames (msec, default: frame time)\n"
+       "  -r --rx       receive DMX, input n of the board into the n-th file\n"
+       "  -i --idle     put the board in idle mode\n"
+       "  -b --break    break time (usec)\n"
+       "  -m --mab      mark-after-break time (usec)\n"
+       "  -c --channels number of channels to send (default 511)\n"
+       "  -V --verbose  debug flags (4: print statistics)\n"
   );
 
   exit(1);
@@ -471,12 +516,17 @@ static const struct option lopts[] = {
 
   // SPI options. 
   { "device",  1, 0, 'D' },
+  { "cpu",     1, 0, 'P' },
+  { "realtime", 2, 0, 'R' },
   { "speed",   1, 0, 's' },
   { "delay",   1, 0, 'd' },
   { "wait",    1, 0, 'w' },
 
   { "idle",      0, 0, 'i' },
   { "rx",        0, 0, 'r' },
+  { "break",     1, 0, 'b' },
+  { "mab",       1, 0, 'm' },
+  { "channels",  1, 0, 'c' },
   // { "addr",      1, 0, 'a' },
   // { "write8",    0, 0, 'w' },
   // { "write",     0, 0, 'W' },
@@ -505,21 +555,62 @@ static const struct option lopts[] = {
 
 
 
+static struct board *new_board (const char *device)
+{
+  struct board *b;
+
+  if (numboards >= MAXBOARD) {
+    fprintf (stderr, "too many boards (max %d)\n", MAXBOARD);
+    exit (1);
+  }
+  b = &boards[numboards++];
+  b->device = device;
+  if (strstr (device, "i2c")) b->mode=I2C_MODE;
+  else                        b->mode=SPI_MODE;
+  b->cpu = -1;
+  return b;
+}
+
+
+static struct board *cur_board (void)
+{
+  if (numboards == 0) 
+    return new_board ("/dev/spidev0.0");
+  return &boards[numboards-1];
+}
+
+
 static int parse_opts(int argc, char *argv[])
 {
+  struct board *b;
+
   while (1) {
     int c;
 
-    c = getopt_long(argc, argv, "D:s:d:rV:w:i", lopts, NULL);
+    // The leading '-' returns the files in order, so that they can be
+    // attached to the -D before them.
+    c = getopt_long(argc, argv, "-D:P:R::s:d:rV:w:ib:m:c:", lopts, NULL);
 
     if (c == -1)
       break;
 
     switch (c) {
+    case 1:
+      b = cur_board ();
+      if (b->numuniv >= MAXUNIV) {
+        fprintf (stderr, "%s: too many universes (max %d)\n", b->device, MAXUNIV);
+        exit (1);
+      }
+      b->univ[b->numuniv++].arg = optarg;
+      break;
     case 'D':
-      device = strdup (optarg);
-      if (strstr (device, "i2c")) mode=I2C_MODE;
-      else                        mode=SPI_MODE;
+      new_board (strdup (optarg));
+      break;
+    case 'P':
+      cur_board ()->cpu = atoi(optarg);
+      break;
+    case 'R':
+      realtime = optarg ? atoi(optarg) : RT_PRIO;
       break;
     case 's':
       speed = atoi(optarg);
@@ -539,6 +630,15 @@ static int parse_opts(int argc, char *argv[])
     case 'i':
       dmxmode = DMX_IDLE;
       break;
+    case 'b':
+      breaktime = atoi(optarg);
+      break;
+    case 'm':
+      mab = atoi(optarg);
+      break;
+    case 'c':
+      nchan = atoi(optarg);
+      break;
 
     case '?':
       print_usage (argv[0]);
@@ -669,92 +769,500 @@ void do_monitor_file (int fd, char *fname)
 
 
 
-#define MAXUNIV 16
+// While the board is still sending, poll it this often.
+#define TX_POLLTIME (4 * DMX_SLOTTIME)
+
+
+/*
+ * Open a universe given as file[=patch][:channels[:break[:mab]]].
+ * What isn't specified comes from the command line options.
+ */
+static void open_dmx_univ (struct dmx_univ *du)
+{
+  char *fname, *p;
+
+  fname = strdup (du->arg);
+  du->cfg.datalen = nchan;
+  du->cfg.breaktime = breaktime;
+  du->cfg.mab = mab;
+
+  p = strchr (fname, ':');
+  if (p) {
+    *p++ = 0;
+    du->cfg.datalen = strtol (p, &p, 0);
+    if (*p == ':') du->cfg.breaktime = strtol (p+1, &p, 0);
+    if (*p == ':') du->cfg.mab = strtol (p+1, &p, 0);
+  }
+  if ((du->cfg.datalen < 1) || (du->cfg.datalen > 512)) {
+    fprintf (stderr, "%s: channels should be 1-512\n", du->arg);
+    exit (1);
+  }
+  du->patch = patch_arg (fname);
+  du->univ = univ_open (fname);
+}
+
+
+// Run the patch, so that the universe file holds what goes out.
+static void apply_patch (struct dmx_univ *du)
+{
+  unsigned char frame[UNIV_NSLOTS];
+
+  if (!du->patch) return;
+  patch_apply (du->patch, frame);
+  univ_write (du->univ, 0, frame, UNIV_NSLOTS);
+}
+
+
+static void set_board_param (struct board *b, int cmd, int u, int val)
+{
+  b->spibuf.cmd = cmd;
+  b->spibuf.p1 = u << 10;
+  b->spibuf.p2 = val;
+  transfer (b, (void*) &b->spibuf, SPI_HDRLEN, 0);
+}
+
+
+static void setup_board (struct board *b)
+{
+  struct dmx_univ *du = b->univ;
+  int u;
+
+  for (u=0;u<b->numuniv;u++) {
+    set_board_param (b, CMD_SETDATALEN, u, du[u].cfg.datalen);
+    if (du[u].cfg.breaktime)
+      set_board_param (b, CMD_SETBREAK, u, du[u].cfg.breaktime);
+    if (du[u].cfg.mab)
+      set_board_param (b, CMD_SETMAB, u, du[u].cfg.mab);
+  }
+}
+
+
+static int frame_wait (struct config *cfg)
+{
+  if (wait) return wait;
+  return dmx_frametime (cfg->datalen,
+                        cfg->breaktime ? cfg->breaktime : DMX_BREAK,
+                        cfg->mab ? cfg->mab : DMX_MAB);
+}
+
+
+// With several boards, frames start on a common clock: at epoch +
+// k * period, where period fits the longest frame of any universe.
+static uint64_t epoch, period;
+
+
+/*
+ * Account for the frame just sent to a universe and schedule the next
+ * one. The reply to the transfer carries the board status for that
+ * universe: while the previous frame is still on the wire the board
+ * answers STAT_TX_ACTIVE and drops the new data, so we come back
+ * shortly and try again. Once accepted, the next frame is due when
+ * this one has left the wire, or at the next tick of the common clock
+ * if the line is free by then.
+ */
+static void tx_status (struct dmx_univ *du, int status, uint64_t now)
+{
+  struct univ_hdr *h = du->univ->hdr;
+  uint64_t ft;
+
+  if (!wait && (status == STAT_TX_ACTIVE)) {
+    h->tx_overruns++;
+    du->next = now + TX_POLLTIME * 1000ULL;
+    return;
+  }
+
+  h->tx_frames++;
+  univ_trace_ship (du->univ, &du->trace, UNIV_STAGE_SPI, now);
+  ft = frame_wait (&du->cfg) * 1000ULL;
+  if (period) {
+    if (now > du->next + period)
+      h->tx_drops += (now - du->next) / period;
+    du->next = epoch + ((now - epoch) / period + 1) * period;
+    // Accepted late: at that tick the line would still be busy, and
+    // we'd only be refused. Once it's free, we're back on the clock.
+    if (du->next < now + ft)
+      du->next = now + ft;
+    return;
+  }
+  if (now > du->next + ft)
+    h->tx_drops += (now - du->next) / ft;
+  du->next = now + ft;
+}
+
+
+// Send a frame through the generic transfer routine: the universe is
+// copied into spibuf, and the reply overwrites it.
+static void send_frame_copy (struct board *b, int u)
+{
+  struct dmx_univ *du = &b->univ[u];
+  int len;
+
+  // Only the start code and the active channels go over the wire.
+  apply_patch (du);
+  len = 1 + du->cfg.datalen;
+  b->spibuf.cmd = CMD_DMX_DATA;
+  b->spibuf.p1 = 0x1 | (u << 10);
+  b->spibuf.p2 = len;
+  univ_trace_take (du->univ, &du->trace);
+  memcpy (b->spibuf.dmxbuf, du->univ->data, len);
+
+  // transfer the header + the datablock.
+  transfer (b, (void*) &b->spibuf, SPI_HDRLEN + len, 0);
+
+  tx_status (du, b->spibuf.cmd, univ_time_ns ());
+}
+
+
+/*
+ * Send frames for several universes in one SPI_IOC_MESSAGE. Each
+ * frame is two segments under one chip select: the header from
+ * du->tx (the reply lands in du->rx), and the DMX data straight out
+ * of the mmapped universe. Nothing gets copied.
+ */
+static void send_frames_spi (struct board *b, int *due, int ndue)
+{
+  struct spi_ioc_transfer tr[2*MAXUNIV];
+  struct dmx_univ *d;
+  uint64_t now;
+  int i, u, len, ret;
+
+  memset (tr, 0, sizeof (tr[0]) * 2 * ndue);
+  for (i=0;i<ndue;i++) {
+    u = due[i];
+    d = &b->univ[u];
+    apply_patch (d);
+    len = 1 + d->cfg.datalen;
+    d->tx.cmd = CMD_DMX_DATA;
+    d->tx.p1 = 0x1 | (u << 10);
+    d->tx.p2 = len;
+    d->rx.cmd = 0;
+    univ_trace_take (d->univ, &d->trace);
+
+    tr[2*i].tx_buf = (unsigned long) &d->tx;
+    tr[2*i].rx_buf = (unsigned long) &d->rx;
+    tr[2*i].len = SPI_HDRLEN;
+    tr[2*i].speed_hz = speed;
+    tr[2*i].bits_per_word = bits;
+
+    tr[2*i+1].tx_buf = (unsigned long) d->univ->data;
+    tr[2*i+1].len = len;
+    tr[2*i+1].speed_hz = speed;
+    tr[2*i+1].bits_per_word = bits;
+    tr[2*i+1].delay_usecs = delay;
+    // deselect between frames, but not after the last one.
+    tr[2*i+1].cs_change = (i != ndue-1);
+  }
+
+  if (debug & DEBUG_TRANSFER)
+    for (i=0;i<ndue;i++)
+      dump_buf ("Before tx:", (void *) &b->univ[due[i]].tx, SPI_HDRLEN);
+
+  ret = ioctl(b->fd, SPI_IOC_MESSAGE(2*ndue), tr);
+  if (ret < 1)
+    pabort("can't send spi message");
+
+  now = univ_time_ns ();
+  for (i=0;i<ndue;i++) {
+    d = &b->univ[due[i]];
+    if (debug & DEBUG_TRANSFER)
+      dump_buf ("rx:", (void *) &d->rx, SPI_HDRLEN);
+    tx_status (d, d->rx.cmd, now);
+  }
+}
+
+
+// spidev refuses messages longer than its bufsiz parameter.
+static int spi_bufsiz (void)
+{
+  FILE *f;
+  int n = 4096;
+
+  f = fopen ("/sys/module/spidev/parameters/bufsiz", "r");
+  if (f) {
+    if (fscanf (f, "%d", &n) != 1) n = 4096;
+    fclose (f);
+  }
+  return n;
+}
+
+
+static void print_stats (struct board *b)
+{
+  struct univ_hdr *h;
+  int u;
+
+  fprintf (stderr, "%s: ", b->device);
+  for (u=0;u<b->numuniv;u++) {
+    h = b->univ[u].univ->hdr;
+    if (dmxmode == DMX_RX) 
+      fprintf (stderr, "%s: %u frames, %u missed, %u nodata, %.1f Hz, jitter %u/%u us.  ",
+               b->univ[u].univ->name, h->rx_frames, h->rx_missed, h->rx_nodata, 
+               h->rx_period ? 1e9 / h->rx_period : 0.0, 
+               h->rx_jitter / 1000, h->rx_jitter_max / 1000);
+    else 
+      fprintf (stderr, "%s: %u frames, %u overruns, %u dropped.  ",
+               b->univ[u].univ->name, h->tx_frames, h->tx_overruns, h->tx_drops);
+  }
+  rt_report ("", "  ");
+  fprintf (stderr, numboards > 1 ? "\n" : "\r");
+}
+
+
+static void do_tx (struct board *b)
+{
+  struct dmx_univ *du = b->univ;
+  int numuniv = b->numuniv;
+  uint64_t now, nextstats;
+  int u, first, ndue, bytes, maxbytes;
+  int due[MAXUNIV];
+
+  maxbytes = spi_bufsiz ();
+  now = period ? epoch : univ_time_ns ();
+  for (u=0;u<numuniv;u++)
+    du[u].next = now;
+  nextstats = now + 1000000000ULL;
+
+  while (1) {
+    // Wait for the universe whose line frees up first.
+    first = 0;
+    for (u=1;u<numuniv;u++)
+      if (du[u].next < du[first].next) first = u;
+    univ_sleep_until (du[first].next);
+
+    if (b->mode != SPI_MODE) {
+      send_frame_copy (b, first);
+    } else {
+      // Take along every other universe that is (almost) due as well.
+      now = univ_time_ns () + TX_POLLTIME * 1000ULL;
+      due[0] = first;
+      ndue = 1;
+      bytes = SPI_HDRLEN + 1 + du[first].cfg.datalen;
+      for (u=0;u<numuniv;u++) {
+        if ((u == first) || (du[u].next > now)) continue;
+        if (bytes + SPI_HDRLEN + 1 + du[u].cfg.datalen > maxbytes) break;
+        bytes += SPI_HDRLEN + 1 + du[u].cfg.datalen;
+        due[ndue++] = u;
+      }
+      send_frames_spi (b, due, ndue);
+    }
+
+    if ((debug & DEBUG_STATS) && (du[first].next > nextstats)) {
+      print_stats (b);
+      nextstats += 1000000000ULL;
+    }
+  }
+}
+
+
+// Until we have seen a few frames, assume a full frame at the
+// default timing.
+#define RX_PERIOD_GUESS (1000ULL * dmx_frametime (512, DMX_BREAK, DMX_MAB))
+// Without a signal, look every so often. 
+#define RX_IDLEPOLL     10000000ULL
+
+
+/*
+ * Handle a new frame: counter is the frame number the board gave it,
+ * buf holds the start code and the slots. Updates the statistics in
+ * the header and returns when to look for the next frame.
+ */
+static uint64_t rx_frame (struct dmx_univ *du, int counter, 
+                          unsigned char *buf, uint64_t now)
+{
+  struct univ_hdr *h = du->univ->hdr;
+  int64_t dt, dev;
+  uint64_t next;
+  int missed;
+
+  missed = counter - du->last - 1;
+  if ((du->last != -1) && (missed > 0) && (missed < 1000)) 
+    h->rx_missed += missed;
+
+  dt = now - h->rx_time;
+  if ((du->last != -1) && (missed >= 0) && (missed < 1000) && (dt < 1000000000)) {
+    // Track the period; frames we didn't see count too. 
+    dt /= missed + 1;
+    if (!h->rx_period) h->rx_period = dt;
+    h->rx_period += (dt - (int64_t) h->rx_period) / 8;
+    // How much it varies, only from consecutive frames. 
+    if (missed == 0) {
+      dev = dt - h->rx_period;
+      if (dev < 0) dev = -dev;
+      h->rx_jitter += (dev - (int64_t) h->rx_jitter) / 8;
+      if (dev > h->rx_jitter_max) h->rx_jitter_max = dev;
+    }
+  }
+  du->last = counter;
+  h->rx_time = now;
+  h->rx_frames++;
+
+  // Only null start code frames carry dimmer levels. 
+  if (buf[0] != 0) {
+    h->rx_altstart++;
+    h->rx_laststart = buf[0];
+  } else 
+    univ_write (du->univ, 0, buf, UNIV_NSLOTS);
+
+  // From when we meant to look, so waking up late doesn't add up. 
+  next = du->next + (h->rx_period ? h->rx_period : RX_PERIOD_GUESS);
+  return (next < now) ? now : next;
+}
+
+
+/*
+ * Receive: input u of the board goes into the u-th universe file. We
+ * poll each input when its next frame should be complete, going by
+ * the measured frame period, and a bit more often while it's late.
+ */
+static void do_rx (struct board *b)
+{
+  struct dmx_univ *du = b->univ;
+  int numuniv = b->numuniv;
+  uint64_t now, retry, nextstats;
+  int u, first;
+
+  now = univ_time_ns ();
+  for (u=0;u<numuniv;u++) {
+    du[u].next = now;
+    du[u].last = -1;
+  }
+  nextstats = now + 1000000000ULL;
+
+  while (1) {
+    first = 0;
+    for (u=1;u<numuniv;u++) 
+      if (du[u].next < du[first].next) first = u;
+    univ_sleep_until (du[first].next);
+    // The time of asking, not of the answer, or the transfer would
+    // add to the period. 
+    now = univ_time_ns ();
+
+    b->spibuf.cmd = CMD_READ_DMX;
+    b->spibuf.p1 = first << 10;
+    b->spibuf.p2 = 0;
+
+    // transfer the header + the datablock. 
+    transfer (b, (void*) &b->spibuf, SPI_HDRLEN + UNIV_NSLOTS, 0); 
+
+    if ((b->spibuf.p1 != du[first].last) && (b->spibuf.cmd != STAT_NODATA)) {
+      du[first].next = rx_frame (&du[first], b->spibuf.p1, b->spibuf.dmxbuf, now);
+    } else if (b->spibuf.cmd == STAT_NODATA) {
+      du[first].univ->hdr->rx_nodata++;
+      du[first].next = now + RX_IDLEPOLL;
+    } else {
+      // Not there yet: try again in a fraction of a frame. 
+      retry = du[first].univ->hdr->rx_period / 8;
+      if (retry < 500000) retry = 500000;
+      du[first].next = now + retry;
+    }
+
+    if ((debug & DEBUG_STATS) && (now > nextstats)) {
+      print_stats (b);
+      nextstats += 1000000000ULL;
+    }
+  }
+}
+
+
+static void *board_thread (void *arg)
+{
+  struct board *b = arg;
+  cpu_set_t cpus;
+
+  if (b->cpu >= 0) {
+    CPU_ZERO (&cpus);
+    CPU_SET (b->cpu, &cpus);
+    if (pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus) != 0)
+      fprintf (stderr, "%s: can't pin to cpu %d\n", b->device, b->cpu);
+  }
+
+  if (dmxmode == DMX_RX) {
+    do_rx (b);
+  } else {
+    setup_board (b);
+    do_tx (b);
+  }
+  return NULL;
+}
+
 
 int main(int argc, char *argv[])
 {
-  int fd;
-  int nonoptions;
-  int last; 
-//  int i, rv;
-//  char typech;
-//  char format[32];
-  char *thefile;
-  int infd;
-  unsigned char *data[MAXUNIV];
-  int nodata = 0;
-  int i, u, numuniv;
+  struct board *b;
+  pthread_attr_t attr;
+  uint64_t ft, xfer, slack = 0;
+  int i, u, bytes, err;
 
   if (argc <= 1) {
     print_usage (argv[0]);
     exit (0);
   }
 
-  nonoptions = parse_opts(argc, argv);
+  parse_opts(argc, argv);
+  cur_board ();
 
-  //fprintf (stderr, "dev = %s\n", device);
-  //fprintf (stderr, "mode = %d\n", mode);
-  fd = open(device, O_RDWR);
-  if (fd < 0)
-    pabort("can't open device");
+  for (i=0;i<numboards;i++) {
+    b = &boards[i];
+    //fprintf (stderr, "dev = %s\n", b->device);
+    //fprintf (stderr, "mode = %d\n", b->mode);
+    b->fd = open(b->device, O_RDWR);
+    if (b->fd < 0)
+      pabort(b->device);
 
-  if (mode == SPI_MODE) setup_spi_mode (fd);
+    if (b->mode == SPI_MODE) setup_spi_mode (b->fd);
 
-  if (dmxmode == DMX_IDLE) {
-    spibuf.cmd = CMD_IDLE;
-    transfer (fd, (void*) &spibuf, 0x209, 0); 
-    exit (0);
-  }   
-
-  numuniv = 0;
-  for (i=nonoptions;i<argc;i++, numuniv++) {
-    thefile = argv[i];
-    infd = open (thefile, O_RDWR); 
-    if (infd < 0) {
-      perror (thefile);
-      exit (1);
-    }
-    data[numuniv] = mmap (NULL, 0x200, PROT_READ | PROT_WRITE, MAP_SHARED, infd, 0);
-    if (data[numuniv] == (void *)-1) {
-      perror ("mmap");
-      exit (1);
+    if (dmxmode == DMX_IDLE) {
+      b->spibuf.cmd = CMD_IDLE;
+      transfer (b, (void*) &b->spibuf, SPI_HDRLEN, 0);
+      continue;
     }
+
+    if (b->numuniv == 0)
+      print_usage (argv[0]);
+    for (u=0;u<b->numuniv;u++)
+      open_dmx_univ (&b->univ[u]);
   }
-  //printf ("got %d unvi.\n", numuniv);
-  last = -1;
-  u = 0;
-  while (1) {
-    if (dmxmode == DMX_TX) {
-      //putchar ('0'+u); fflush (stdout);
-      spibuf.cmd = CMD_DMX_DATA;
-      spibuf.p1 = 0x1 | (u << 10);
-      spibuf.p2 = 0x200;
-      memcpy (spibuf.dmxbuf, data[u++], 0x200);
-      if (u >= numuniv) u = 0;
-    }
+  if (dmxmode == DMX_IDLE)
+    exit (0);
 
-    if (dmxmode == DMX_RX) {
-       spibuf.cmd = CMD_READ_DMX;
+  //printf ("got %d unvi.\n", numuniv);
+  if ((dmxmode == DMX_TX) && (numboards > 1)) {
+    // Lock all boards to one frame clock that fits the longest frame.
+    // A frame only starts once its transfer is done, a little after
+    // the tick: leave room for the longest transfer and a late
+    // wakeup, or the board is still busy at the next tick.
+    for (i=0;i<numboards;i++) {
+      bytes = 0;
+      for (u=0;u<boards[i].numuniv;u++) {
+        ft = frame_wait (&boards[i].univ[u].cfg) * 1000ULL;
+        if (ft > period) period = ft;
+        bytes += SPI_HDRLEN + 1 + boards[i].univ[u].cfg.datalen;
+      }
+      xfer = bytes * 8 * 1000000000ULL / speed;
+      if (xfer > slack) slack = xfer;
     }
+    period += slack + TX_POLLTIME * 1000ULL;
+    // Give all threads the time to get going before the first tick.
+    epoch = univ_time_ns () + 20000000ULL;
+  }
 
-    // transfer 8 byte header + 513 byte datablock. 
-    transfer (fd, (void*) &spibuf, 0x209, 0); 
-
-    if (dmxmode == DMX_RX) {
-       if (spibuf.p1 != last) {
-          memcpy (data[0], spibuf.dmxbuf, 0x200);
-          last = spibuf.p1;
-       } else {
-          if (spibuf.cmd == STAT_RX_IN_PROGRESS) {
-             usleep (1000);
-             continue;
-          }
-          printf ("no data %d\r", nodata++); 
-          fflush (stdout);
-       }
+  // The board threads inherit the scheduling and the locked memory;
+  // small stacks, so that locking them stays within the limit.
+  if (realtime)
+    rt_setup (realtime, -1);
+
+  pthread_attr_init (&attr);
+  pthread_attr_setstacksize (&attr, RT_STACK);
+  for (i=0;i<numboards;i++) {
+    err = pthread_create (&boards[i].thread, &attr, board_thread, &boards[i]);
+    if (err != 0) {
+      fprintf (stderr, "pthread_create: %s\n", strerror (err));
+      exit (1);
     }
-    usleep (wait);
   }
+  pthread_attr_destroy (&attr);
+  for (i=0;i<numboards;i++)
+    pthread_join (boards[i].thread, NULL);
 
   exit (0);
 }
@@ -1,5 +1,11 @@
 
 
+#include <stddef.h>
+
+struct spi_hdr {
+  int cmd;
+  int p1, p2;
+};
 
 struct spi_txrx {
   int cmd;
@@ -15,6 +21,9 @@ struct spi_txrx spi_in, spi_out;
 #define dmxbuf rest.r_dmxbuf
 #define params rest.r_params
 
+// cmd, p1 and p2 go out before the DMX data. 
+#define SPI_HDRLEN offsetof (struct spi_txrx, rest)
+
 
 
 struct config {
@@ -28,6 +37,25 @@ struct config {
 enum mode_t { DMX_IDLE, DMX_TX, DMX_RX};
 
 
+/* ******************** line timing *******************************/
+// At 250kbaud a slot is 11 bits: start bit, 8 data bits, 2 stop bits. 
+#define DMX_SLOTTIME    44     // usec
+#define DMX_BREAK       176    // usec, what the board uses by default
+#define DMX_MAB         12     // usec
+#define DMX_MINFRAME    1204   // usec, shortest frame the standard allows
+
+// The time the frame with nchan channels (plus start code) keeps the
+// line busy.
+static inline int dmx_frametime (int nchan, int breaktime, int mab)
+{
+  int t;
+
+  t = breaktime + mab + (1 + nchan) * DMX_SLOTTIME;
+  if (t < DMX_MINFRAME) t = DMX_MINFRAME;
+  return t;
+}
+
+
 /* ******************** the protocol *******************************/
 enum spi_cmd_t { CMD_DMXDATA=0x1234, 
                  CMD_DMX_DATA,
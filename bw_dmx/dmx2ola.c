@@ -35,6 +35,8 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
 
 
 #include <linux/types.h>
@@ -42,6 +44,8 @@
 #include <linux/i2c-dev.h>
 
 #include "dmx.h"
+#include "universe.h"
+#include "dmxnet.h"
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
@@ -59,9 +63,13 @@ static uint8_t bits = 8;
 
 static uint32_t speed = 6000000;
 static int delay = 0;
-static int wait = 22000;
 static int universe = 0;
 
+enum { OUT_OLA, OUT_ARTNET, OUT_E131, OUT_BINARY };
+static int output = OUT_OLA;
+static char *host = NULL;
+static int priority = E131_PRIORITY;
+
 
 static int debug = 0;
 #define DEBUG_REGSETTING 0x0001
@@ -235,21 +243,18 @@ static void transfer(int fd, unsigned char *buf, int tlen, int rlen)
 
 static void print_usage(const char *prog)
 {
-  printf("Usage: %s [-DsbdlHOLC3]\n", prog);
-  puts("  -D --device   device to use (default /dev/spidev1.1)\n"
+  printf("Usage: %s [-Dsduaebhp]\n", prog);
+  puts("  -D --device   device to use (default /dev/spidev0.0)\n"
        "  -s --speed    max speed (Hz)\n"
        "  -d --delay    delay (usec)\n"
-       "  -r --rx      \n"
-       "  -v --val      value\n"
-       "  -a --addr     address\n"
-       "  -w --write8   write an octet\n"
-       "  -W --write    write arbitrary type\n"
-       "  -i --interval set the interval\n"
-       "  -S --scan     Scan the bus for devices \n"
-       "  -R --read     multi-datasize read\n"
-       "  -I --i2c      I2C mode (uses /dev/i2c-0, change with -D)\n"
-       "  -U --usb      USB mode (uses /dev/ttyACM0, change with -D)\n"
-       "  -1 --decimal  Numbers are decimal. (registers remain in hex)\n"
+       "  -u --universe universe number to send as\n"
+       "  -a --artnet   send Art-Net (broadcast unless -h is given)\n"
+       "  -e --e131     send E1.31/sACN (multicast unless -h is given)\n"
+       "  -b --binary   write binary frames to stdout: universe and length\n"
+       "                (16 bits, big endian), start code and channels\n"
+       "  -h --host     host to send Art-Net or E1.31 to\n"
+       "  -p --priority E1.31 priority (default 100)\n"
+       "Without -a, -e or -b, frames go to ola_streaming_client.\n"
   );
 
   exit(1);
@@ -263,6 +268,11 @@ static const struct option lopts[] = {
   { "delay",   1, 0, 'd' },
 
   { "universe",  1, 0, 'u' },
+  { "artnet",    0, 0, 'a' },
+  { "e131",      0, 0, 'e' },
+  { "binary",    0, 0, 'b' },
+  { "host",      1, 0, 'h' },
+  { "priority",  1, 0, 'p' },
 
   { "help",      0, 0, '?' },
   { NULL, 0, 0, 0 },
@@ -275,7 +285,7 @@ static int parse_opts(int argc, char *argv[])
   while (1) {
     int c;
 
-    c = getopt_long(argc, argv, "D:s:d:u:?", lopts, NULL);
+    c = getopt_long(argc, argv, "D:s:d:u:aebh:p:?", lopts, NULL);
 
     if (c == -1)
       break;
@@ -295,6 +305,21 @@ static int parse_opts(int argc, char *argv[])
     case 'u':
       universe = atoi(optarg);
       break;
+    case 'a':
+      output = OUT_ARTNET;
+      break;
+    case 'e':
+      output = OUT_E131;
+      break;
+    case 'b':
+      output = OUT_BINARY;
+      break;
+    case 'h':
+      host = strdup (optarg);
+      break;
+    case 'p':
+      priority = atoi(optarg);
+      break;
 
     case '?':
       print_usage (argv[0]);
@@ -354,18 +379,137 @@ void setup_spi_mode (int fd)
 
 
 
+/*
+ * Text for ola_streaming_client: all 512 channels as one line of
+ * comma separated decimals. The digits come from a table and the line
+ * goes out in one write; printf-ing every value was what kept the pi
+ * busy.
+ */
+static char dec[256][4];
+static unsigned char declen[256];
+
+static void init_dec (void)
+{
+  int i;
+
+  for (i=0;i<256;i++)
+    declen[i] = sprintf (dec[i], "%d", i);
+}
+
+
+static int format_frame (char *out, unsigned char *slots)
+{
+  int i, n = 0;
+
+  // The DMX data starts at offset 1.
+  for (i=1;i<UNIV_NSLOTS;i++) {
+    memcpy (out + n, dec[slots[i]], 4);
+    n += declen[slots[i]];
+    out[n++] = ',';
+  }
+  out[n-1] = '\n';
+  return n;
+}
+
+
+static FILE *ola_streaming_fp;
+static int netfd;
+static unsigned char cid[E131_CIDLEN];
+static int seq;
+
+static void open_output (void)
+{
+  char ola_streaming_cmd[0x80];
+  char mcast[0x20];
+
+  switch (output) {
+  case OUT_OLA:
+    init_dec ();
+    sprintf (ola_streaming_cmd, "ola_streaming_client -u %d", universe);
+    ola_streaming_fp = popen (ola_streaming_cmd, "w");
+    if (ola_streaming_fp == NULL ) {
+      perror ("opening pipe to ola_streaming_client");
+      exit (1);
+    }
+    break;
+  case OUT_ARTNET:
+    netfd = dmxnet_open (host ? host : "255.255.255.255", ARTNET_PORT);
+    break;
+  case OUT_E131:
+    e131_make_cid (cid);
+    if (!host) {
+      e131_mcast_addr (mcast, universe);
+      host = strdup (mcast);
+    }
+    netfd = dmxnet_open (host, E131_PORT);
+    break;
+  }
+}
+
+
+// Send the start code and the 512 channels in slots.
+static void send_frame (unsigned char *slots)
+{
+  unsigned char hdr[E131_HDRLEN];
+  char text[UNIV_NSLOTS * 4];
+  struct iovec iov[2];
+  uint16_t bhdr[2];
+  int n;
+
+  iov[1].iov_base = slots + 1;
+  iov[1].iov_len = UNIV_NSLOTS - 1;
+  switch (output) {
+  case OUT_OLA:
+    n = format_frame (text, slots);
+    if (fwrite (text, 1, n, ola_streaming_fp) != n)
+      pabort ("writing to ola_streaming_client");
+    fflush (ola_streaming_fp);
+    return;
+  case OUT_BINARY:
+    bhdr[0] = htons (universe);
+    bhdr[1] = htons (UNIV_NSLOTS);
+    iov[0].iov_base = bhdr;
+    iov[0].iov_len = sizeof (bhdr);
+    iov[1].iov_base = slots;
+    iov[1].iov_len = UNIV_NSLOTS;
+    if (writev (1, iov, 2) < 0)
+      pabort ("stdout");
+    return;
+  case OUT_ARTNET:
+    // Art-Net sequence numbers run from 1 to 255: 0 means "not used".
+    seq = (seq % 255) + 1;
+    iov[0].iov_len = artnet_header (hdr, universe, seq, UNIV_NSLOTS - 1);
+    break;
+  case OUT_E131:
+    seq = (seq + 1) & 0xff;
+    iov[0].iov_len = e131_header (hdr, cid, "dmx2ola", universe, priority,
+                                  seq, slots[0], UNIV_NSLOTS - 1);
+    break;
+  }
+  iov[0].iov_base = hdr;
+  // Nobody listening is not a reason to stop.
+  if (writev (netfd, iov, 2) < 0)
+    perror ("send");
+}
+
+
+// Network receivers expect to hear from us now and then, even when
+// nothing changes.
+#define KEEPALIVE 1000000000ULL
+
+// Until the frame period has been measured, guess a full frame.
+#define RX_PERIOD_GUESS (1000ULL * dmx_frametime (512, DMX_BREAK, DMX_MAB))
+// Without a signal, look every so often.
+#define RX_IDLEPOLL     10000000ULL
+
 int main(int argc, char *argv[])
 {
+  struct univ_range r[1];
   int fd;
   //int nonoptions;
-  int last; 
-  int i;
-  char ola_streaming_cmd[0x80];
-  FILE *ola_streaming_fp;
-  //int infd;
-  unsigned char data[0x210];
-  int nodata = 0;
-  int yesdata = 0;
+  int last, n;
+  unsigned char data[UNIV_NSLOTS];
+  uint64_t now, next, retry, dt, lastsent = 0, lastframe = 0, period = 0;
 
 #if 0
   if (argc <= 1) {
@@ -374,7 +518,7 @@ int main(int argc, char *argv[])
   }
 #endif
 
-  //  nonoptions = 
+  //  nonoptions =
   parse_opts(argc, argv);
 
   //fprintf (stderr, "dev = %s\n", device);
@@ -386,44 +530,56 @@ int main(int argc, char *argv[])
 
   if (mode == SPI_MODE) setup_spi_mode (fd);
 
-  sprintf (ola_streaming_cmd, "ola_streaming_client -u %d", universe);
-  ola_streaming_fp = popen (ola_streaming_cmd, "w");
-  if (ola_streaming_fp == NULL ) {
-    perror ("opening pipe to ola_streaming_client"); 
-    exit (1);
-  }
-  
+  open_output ();
+
+  memset (data, 0, sizeof (data));
   last = -1;
+  next = univ_time_ns ();
+  // Look when the next frame should be complete, going by the
+  // measured frame period, and a bit more often while it's late.
   while (1) {
-    spibuf.cmd = CMD_READ_DMX;
+    univ_sleep_until (next);
+    now = univ_time_ns ();
 
-    // transfer 8 byte header + 513 byte datablock. 
-    transfer (fd, (void*) &spibuf, 0x209, 0); 
-
-    if (spibuf.p1 != last) {
-      if (memcmp (data, spibuf.dmxbuf, 0x200) != 0) {
-	memcpy (data, spibuf.dmxbuf, 0x200);
-	// The DMX data starts at offset 1. 
-	for (i=1;i<512;i++)
-	  fprintf (ola_streaming_fp, "%d,", data[i]);
-	//fprintf (ola_streaming_fp, "%d\n", data[i]);
-	fflush (ola_streaming_fp);
+    spibuf.cmd = CMD_READ_DMX;
+    // Input 0. The reply overwrote what we asked for last time.
+    spibuf.p1 = 0;
+    spibuf.p2 = 0;
+
+    // transfer the header + the datablock.
+    transfer (fd, (void*) &spibuf, SPI_HDRLEN + UNIV_NSLOTS, 0);
+
+    if ((spibuf.p1 != last) && (spibuf.cmd != STAT_NODATA)) {
+      // Frames we didn't see count too. Times are those of asking,
+      // not of the answer, or the transfer would add to the period.
+      n = spibuf.p1 - last;
+      if ((last != -1) && (n > 0) && (n < 1000) &&
+          (now - lastframe < 1000000000ULL)) {
+        dt = (now - lastframe) / n;
+        if (!period) period = dt;
+        period += ((int64_t) dt - (int64_t) period) / 8;
+      }
+      if (univ_diff (data, spibuf.dmxbuf, UNIV_NSLOTS, r, 1) ||
+          ((output != OUT_OLA) && (now - lastsent > KEEPALIVE))) {
+        memcpy (data, spibuf.dmxbuf, UNIV_NSLOTS);
+        send_frame (data);
+        lastsent = now;
       }
       last = spibuf.p1;
-      printf ("data/nodata %d/%d \r", yesdata++, nodata); 
-      fflush (stdout);
+      lastframe = now;
+      // From when we meant to look, so waking up late doesn't add up.
+      next += period ? period : RX_PERIOD_GUESS;
+      if (next < now) next = now;
+    } else if (spibuf.cmd == STAT_NODATA) {
+      next = now + RX_IDLEPOLL;
     } else {
-      if (spibuf.cmd == STAT_RX_IN_PROGRESS) {
-	usleep (1000);
-	continue;
-      }
-      printf ("data/nodata %d/%d \r", yesdata, nodata++); 
-      fflush (stdout);
+      // Not there yet: try again in a fraction of a frame.
+      retry = period / 8;
+      if (retry < 500000) retry = 500000;
+      next = now + retry;
     }
-    
-    usleep (wait);
   }
-  
+
 
   exit (0);
 }
@@ -0,0 +1,365 @@
+/*
+ * dmx_fade.c
+ *
+ * Fade engine: crossfades universes to scenes, or channels to levels,
+ * at the frame rate, driven by commands on stdin or a fifo (-c):
+ *
+ *   fade U scene T          fade universe U to the scene file in T s
+ *   set U chan[-chan] V [T] fade channels to V (0-65535 on a fine pair)
+ *   fine U chan[-chan]      chan, chan+2, ... are 16 bit: coarse, then
+ *                           fine in the next channel
+ *   stop U                  stop all fades of U where they are
+ *
+ * Universes are numbered from 0 in command line order, channels as
+ * set_dmx numbers them. A scene file is anything that holds the 513
+ * slots at its start, like a universe file.
+ *
+ * Every channel is a 16 bit level in 16.16 fixed point with its own
+ * step and frame count, so fades of different lengths can overlap.
+ * Each frame all running channels take their step, four at a time;
+ * a channel that arrives is set to exactly its target.
+ *
+ * Only the channels that are fading are written, so other programs
+ * can change the rest of a universe. A fade starts from the level the
+ * channel has in the universe at that moment.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "universe.h"
+
+#define MAXUNIV  16
+#define NCHAN    (UNIV_NSLOTS - 1)
+
+typedef int32_t v4si __attribute__ ((vector_size (16)));
+typedef uint32_t v4su __attribute__ ((vector_size (16)));
+
+enum { CH_8BIT, CH_COARSE, CH_FINE };
+
+struct fade_univ {
+  struct universe *univ;
+  uint32_t cur[NCHAN] __attribute__ ((aligned (16)));    // 16.16 fixed
+  uint32_t target[NCHAN] __attribute__ ((aligned (16)));
+  int32_t step[NCHAN] __attribute__ ((aligned (16)));
+  int32_t left[NCHAN] __attribute__ ((aligned (16)));    // frames to go
+  unsigned char type[NCHAN];
+  unsigned char moving[NCHAN];      // to be written in the next frame
+  int running;                      // frames until all fades are done
+};
+
+static struct fade_univ univ[MAXUNIV];
+static int numuniv;
+
+static int interval = 22727;        // 44 Hz
+static char *fifoname = NULL;
+
+
+static void print_usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-ic] file ...\n", prog);
+  fputs("  -i --interval frame interval (usec, default 22727: 44 Hz)\n"
+        "  -c --command  also read commands from this fifo\n", stderr);
+  exit(EXIT_FAILURE);
+}
+
+static const struct option lopts[] = {
+  { "interval",  1, 0, 'i' },
+  { "command",   1, 0, 'c' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
+
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "i:c:", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'i':interval = atoi (optarg);break;
+    case 'c':fifoname = optarg;break;
+    default: print_usage (argv[0]);break;
+    }
+  }
+  return optind;
+}
+
+
+// Fade channel c to the 16 bit level v in n frames.
+static void fade_chan (struct fade_univ *fu, int c, int v, int n)
+{
+  unsigned char *d = fu->univ->data + c + 1;
+
+  // A new fade starts from what the universe holds now.
+  if (!fu->moving[c]) {
+    if (fu->type[c] == CH_COARSE)
+      fu->cur[c] = ((uint32_t) d[0] << 24) | ((uint32_t) d[1] << 16);
+    else
+      fu->cur[c] = (uint32_t) (d[0] * 257) << 16;
+  }
+  fu->moving[c] = 1;
+  fu->target[c] = (uint32_t) v << 16;
+  fu->step[c] = ((int64_t) fu->target[c] - fu->cur[c]) / n;
+  fu->left[c] = n;
+  if (n > fu->running) fu->running = n;
+}
+
+
+static int frames (double secs)
+{
+  int n;
+
+  n = secs * 1e6 / interval + 0.5;
+  return n < 1 ? 1 : n;
+}
+
+
+static void load_scene (char *fname, unsigned char *slots)
+{
+  int fd, n;
+
+  memset (slots, 0, UNIV_NSLOTS);
+  fd = open (fname, O_RDONLY);
+  if (fd < 0) {
+    perror (fname);
+    return;
+  }
+  n = read (fd, slots, UNIV_NSLOTS);
+  if (n < 0) perror (fname);
+  close (fd);
+}
+
+
+static void cmd_fade (struct fade_univ *fu, char *scene, double secs)
+{
+  unsigned char s[UNIV_NSLOTS];
+  int c, n;
+
+  load_scene (scene, s);
+  n = frames (secs);
+  for (c=0;c<NCHAN;c++) {
+    switch (fu->type[c]) {
+    case CH_8BIT:   fade_chan (fu, c, s[c+1] * 257, n);break;
+    case CH_COARSE: fade_chan (fu, c, (s[c+1] << 8) | s[c+2], n);break;
+    case CH_FINE:   break;
+    }
+  }
+}
+
+
+static int parse_range (char *s, int *a, int *b)
+{
+  *a = *b = strtol (s, &s, 0);
+  if (*s == '-') *b = strtol (s+1, &s, 0);
+  return !*s && (*a >= 0) && (*b < NCHAN) && (*a <= *b);
+}
+
+
+static void do_command (char *line)
+{
+  struct fade_univ *fu;
+  char *argv[6];
+  int argc, a, b, c, v, n;
+
+  for (argc=0;argc<6;argc++)
+    if (!(argv[argc] = strtok (argc ? NULL : line, " \t\r\n")))
+      break;
+  if ((argc == 0) || (argv[0][0] == '#'))
+    return;
+  if ((argc < 2) || ((n = atoi (argv[1])) < 0) || (n >= numuniv)) {
+    fprintf (stderr, "%s: no such universe\n", argv[0]);
+    return;
+  }
+  fu = &univ[n];
+
+  if ((strcmp (argv[0], "fade") == 0) && (argc == 4)) {
+    cmd_fade (fu, argv[2], atof (argv[3]));
+  } else if ((strcmp (argv[0], "set") == 0) && (argc >= 4) &&
+             parse_range (argv[2], &a, &b)) {
+    v = strtol (argv[3], NULL, 0);
+    n = frames (argc > 4 ? atof (argv[4]) : 0);
+    for (c=a;c<=b;c++)
+      switch (fu->type[c]) {
+      case CH_8BIT:   fade_chan (fu, c, (v & 0xff) * 257, n);break;
+      case CH_COARSE: fade_chan (fu, c, v & 0xffff, n);break;
+      case CH_FINE:   break;
+      }
+  } else if ((strcmp (argv[0], "fine") == 0) && (argc == 3) &&
+             parse_range (argv[2], &a, &b) && (b < NCHAN - 1)) {
+    for (c=a;c<=b;c+=2) {
+      fu->type[c] = CH_COARSE;
+      fu->type[c+1] = CH_FINE;
+    }
+  } else if ((strcmp (argv[0], "stop") == 0) && (argc == 2)) {
+    memset (fu->left, 0, sizeof (fu->left));
+    memset (fu->moving, 0, sizeof (fu->moving));
+    fu->running = 0;
+  } else {
+    fprintf (stderr, "%s: bad command\n", argv[0]);
+  }
+}
+
+
+/*
+ * Advance all running fades of a universe by one frame. A channel
+ * takes its step while it has frames left; on the last one it lands
+ * on its target, so rounding in the step never shows.
+ */
+static void step_univ (struct fade_univ *fu)
+{
+  v4su cur, tgt;
+  v4si step, left, run, done;
+  int i;
+
+  for (i=0;i<NCHAN;i+=4) {
+    memcpy (&left, fu->left + i, 16);
+    run = left > 0;
+    if (!(run[0] | run[1] | run[2] | run[3]))
+      continue;
+    memcpy (&cur, fu->cur + i, 16);
+    memcpy (&tgt, fu->target + i, 16);
+    memcpy (&step, fu->step + i, 16);
+    cur += (v4su) (step & run);
+    left += run;                    // run is -1 where running
+    done = run & (left == 0);
+    cur = (cur & ~(v4su) done) | (tgt & (v4su) done);
+    memcpy (fu->cur + i, &cur, 16);
+    memcpy (fu->left + i, &left, 16);
+  }
+  fu->running--;
+}
+
+
+/*
+ * Write the channels that are fading, and the ones that arrived this
+ * frame, into the universe. Runs of neighbouring channels are marked
+ * dirty together.
+ */
+static void output_univ (struct fade_univ *fu)
+{
+  struct universe *u = fu->univ;
+  int c, start = 0, end = 0;
+
+  for (c=0;c<NCHAN;c++) {
+    if (!fu->moving[c]) continue;
+    if (c > end) {
+      if (end > start) univ_mark (u, start + 1, end - start);
+      start = c;
+    }
+    u->data[c+1] = fu->cur[c] >> 24;
+    end = c + 1;
+    // The fine channel gets the low byte of its coarse channel's level.
+    if (fu->type[c] == CH_COARSE) {
+      u->data[c+2] = fu->cur[c] >> 16;
+      end = c + 2;
+    }
+    if (!fu->left[c]) fu->moving[c] = 0;
+  }
+  if (end > start) univ_mark (u, start + 1, end - start);
+  univ_commit (u);
+}
+
+
+struct cmdsrc {
+  int fd;
+  int len;
+  char buf[0x400];
+};
+
+
+// Run the complete lines that have come in on fd.
+static void read_commands (struct cmdsrc *cs)
+{
+  char *p, *nl;
+  int n;
+
+  n = read (cs->fd, cs->buf + cs->len, sizeof (cs->buf) - 1 - cs->len);
+  if (n <= 0) {
+    if ((n < 0) && (errno == EAGAIN)) return;
+    cs->fd = -1;                    // EOF: stop polling it.
+    return;
+  }
+  cs->len += n;
+  cs->buf[cs->len] = 0;
+  for (p=cs->buf;(nl = strchr (p, '\n'));p=nl+1) {
+    *nl = 0;
+    do_command (p);
+  }
+  cs->len -= p - cs->buf;
+  memmove (cs->buf, p, cs->len);
+  // A line that doesn't fit is thrown away.
+  if (cs->len == sizeof (cs->buf) - 1) cs->len = 0;
+}
+
+
+int main(int argc, char **argv)
+{
+  static struct cmdsrc cmds[2];
+  struct pollfd pfd[2];
+  uint64_t next;
+  int nonoptions, i, ncmd = 0;
+
+  nonoptions = parse_opts(argc, argv);
+  if ((nonoptions >= argc) || (argc - nonoptions > MAXUNIV))
+    print_usage (argv[0]);
+
+  for (i=nonoptions;i<argc;i++) {
+    univ[numuniv].univ = univ_open (argv[i]);
+    numuniv++;
+  }
+
+  cmds[ncmd++].fd = 0;
+  if (fifoname) {
+    if ((mkfifo (fifoname, 0666) < 0) && (errno != EEXIST))
+      perror (fifoname);
+    // Opened for writing as well, so we never see EOF when a writer
+    // goes away.
+    cmds[ncmd].fd = open (fifoname, O_RDWR | O_NONBLOCK);
+    if (cmds[ncmd].fd < 0) {
+      perror (fifoname);
+      exit (1);
+    }
+    ncmd++;
+  }
+
+  next = univ_time_ns ();
+  while (1) {
+    univ_sleep_until (next);
+    next += interval * 1000ULL;
+
+    for (i=0;i<ncmd;i++) {
+      pfd[i].fd = cmds[i].fd;
+      pfd[i].events = POLLIN;
+    }
+    if (poll (pfd, ncmd, 0) > 0)
+      for (i=0;i<ncmd;i++)
+        if (pfd[i].revents & (POLLIN | POLLHUP))
+          read_commands (&cmds[i]);
+
+    for (i=0;i<numuniv;i++)
+      if (univ[i].running > 0) {
+        step_univ (&univ[i]);
+        output_univ (&univ[i]);
+      }
+  }
+
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,318 @@
+/*
+ * dmx_fx.c
+ *
+ * Effects engine: runs the effects of a program file on one or more
+ * universes, every frame. The program has one effect per line:
+ *
+ *   # universe channels effect     parameters
+ *   0          0-11     sine       period 2 spread 360
+ *   0          12-23    chase      period 1.5
+ *   0          24-47    rainbow    period 10
+ *   1          0        strobe     period 0.1 duty 20 max 200
+ *   1          1-64     random     period 0.025
+ *
+ * Effects are sine, saw, triangle, square, strobe, chase, rainbow and
+ * random. Parameters: period (s), phase and spread (degrees: spread
+ * is divided over the channels, or over the RGB fixtures for
+ * rainbow, so that the effect runs from the first to the last), duty
+ * (%), min and max. Universes are the files on the command line,
+ * from 0; channels are numbered as set_dmx does.
+ *
+ * The program is compiled into one flat list of instructions, one per
+ * channel, each with its own phase and phase step. A frame is a single
+ * pass over that list: no allocation, no parsing, one table lookup
+ * per channel. Channels without an effect are left to whoever else
+ * writes the universe.
+ *
+ * With -V the time the evaluation takes is reported every second.
+ * -B sets a budget per frame and turns the report on: frames that
+ * take longer are counted there. It is only a count; the effects run
+ * all the same.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+
+#include "universe.h"
+
+#define MAXUNIV  16
+#define MAXINS   (MAXUNIV * (UNIV_NSLOTS - 1))
+#define NCHAN    (UNIV_NSLOTS - 1)
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+enum fx_op { FX_SINE, FX_SAW, FX_TRIANGLE, FX_SQUARE, FX_RAINBOW, FX_RANDOM };
+
+struct fx_ins {
+  uint32_t phase;                   // a full cycle is 2^32
+  uint32_t rate;                    // phase step per frame
+  unsigned short slot;
+  unsigned char op, univ;
+  unsigned char min, range;
+  unsigned char val;                // random: the current value
+  unsigned short param;             // duty (of 256), or RGB component
+};
+
+static struct fx_ins ins[MAXINS];
+static int nins;
+
+static struct universe *univ[MAXUNIV];
+static int numuniv;
+
+static unsigned char sine[256], rainbow[256];
+
+static int interval = 22727;        // 44 Hz
+static int budget = 0;              // usec, 0: no budget
+static int verbose = 0;
+
+
+static void print_usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-iBV] program file ...\n", prog);
+  fputs("  -i --interval frame interval (usec, default 22727: 44 Hz)\n"
+        "  -B --budget   count the frames that take longer than this\n"
+        "                (usec); implies -V\n"
+        "  -V --verbose  report evaluation time every second\n", stderr);
+  exit(EXIT_FAILURE);
+}
+
+static const struct option lopts[] = {
+  { "interval",  1, 0, 'i' },
+  { "budget",    1, 0, 'B' },
+  { "verbose",   0, 0, 'V' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
+
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "i:B:V", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'i':interval = atoi (optarg);break;
+    case 'B':budget = atoi (optarg);verbose = 1;break;
+    case 'V':verbose = 1;break;
+    default: print_usage (argv[0]);break;
+    }
+  }
+  return optind;
+}
+
+
+static void make_tables (void)
+{
+  int i, h;
+
+  for (i=0;i<256;i++) {
+    sine[i] = 127.5 - 127.5 * cos (i * 2 * M_PI / 256) + 0.5;
+    // The red component of the hue wheel: green and blue are the same
+    // curve a third and two thirds of the way round.
+    h = (i + 43) % 256;
+    if      (h < 86)  rainbow[i] = 255;
+    else if (h < 128) rainbow[i] = 255 - (h - 86) * 255 / 42;
+    else if (h < 214) rainbow[i] = 0;
+    else              rainbow[i] = (h - 214) * 255 / 42;
+  }
+}
+
+
+static const struct {
+  char *name;
+  int op;
+  int duty;                         // default, in %
+  int spread;                       // default, in degrees
+} effects[] = {
+  { "sine",     FX_SINE,     50,   0 },
+  { "saw",      FX_SAW,      50,   0 },
+  { "triangle", FX_TRIANGLE, 50,   0 },
+  { "square",   FX_SQUARE,   50,   0 },
+  { "strobe",   FX_SQUARE,   10,   0 },
+  { "chase",    FX_SQUARE,    0, 360 },
+  { "rainbow",  FX_RAINBOW,  50,   0 },
+  { "random",   FX_RANDOM,   50,   0 },
+};
+
+
+static void fx_error (char *fname, int line, char *msg)
+{
+  fprintf (stderr, "%s:%d: %s\n", fname, line, msg);
+  exit (1);
+}
+
+
+// Compile one line of the program into instructions.
+static void compile_line (char *fname, int line, char *buf)
+{
+  struct fx_ins *in;
+  char *t, *v;
+  double period = 1, phase = 0, spread, duty;
+  int u, a, b, e, c, n, k, min = 0, max = 255;
+
+  if ((t = strchr (buf, '#'))) *t = 0;
+  if (!(t = strtok (buf, " \t\r\n"))) return;
+  u = atoi (t);
+  if ((u < 0) || (u >= numuniv))
+    fx_error (fname, line, "no such universe");
+  if (!(t = strtok (NULL, " \t\r\n")))
+    fx_error (fname, line, "missing channels");
+  a = b = strtol (t, &t, 0);
+  if (*t == '-') b = strtol (t+1, &t, 0);
+  if (*t || (a < 0) || (b >= NCHAN) || (a > b))
+    fx_error (fname, line, "bad channel range");
+  if (!(t = strtok (NULL, " \t\r\n")))
+    fx_error (fname, line, "missing effect");
+  for (e=0;e<ARRAY_SIZE (effects);e++)
+    if (strcmp (t, effects[e].name) == 0) break;
+  if (e == ARRAY_SIZE (effects))
+    fx_error (fname, line, "unknown effect");
+
+  n = b - a + 1;
+  duty = effects[e].duty ? effects[e].duty : 100.0 / n;
+  spread = effects[e].spread;
+  while ((t = strtok (NULL, " \t\r\n"))) {
+    if (!(v = strtok (NULL, " \t\r\n")))
+      fx_error (fname, line, "parameter without a value");
+    if      (strcmp (t, "period") == 0) period = atof (v);
+    else if (strcmp (t, "phase") == 0)  phase = atof (v);
+    else if (strcmp (t, "spread") == 0) spread = atof (v);
+    else if (strcmp (t, "duty") == 0)   duty = atof (v);
+    else if (strcmp (t, "min") == 0)    min = atoi (v);
+    else if (strcmp (t, "max") == 0)    max = atoi (v);
+    else fx_error (fname, line, "unknown parameter");
+  }
+  if ((period <= 0) || (min < 0) || (max > 255) || (min > max) ||
+      (duty < 0) || (duty > 100))
+    fx_error (fname, line, "bad parameter");
+  // The phase has to go round less than once a frame.
+  if (period * 1e6 <= interval)
+    fx_error (fname, line, "period shorter than a frame");
+
+  // Rainbows go over RGB fixtures: three channels each.
+  if (effects[e].op == FX_RAINBOW) n = (n + 2) / 3;
+  for (c=a;c<=b;c++) {
+    if (nins >= MAXINS)
+      fx_error (fname, line, "too many channels");
+    in = &ins[nins++];
+    k = (effects[e].op == FX_RAINBOW) ? (c - a) / 3 : c - a;
+    in->phase = (uint32_t) (int64_t) ((phase - spread * k / n) / 360 * 4294967296.0);
+    in->rate = interval / (period * 1e6) * 4294967296.0;
+    in->slot = c + 1;
+    in->op = effects[e].op;
+    in->univ = u;
+    in->min = min;
+    in->range = max - min;
+    in->param = (effects[e].op == FX_RAINBOW) ? (c - a) % 3 * 85 : duty * 2.56;
+    in->val = min;
+  }
+}
+
+
+static void compile (char *fname)
+{
+  char buf[0x200];
+  FILE *f;
+  int line;
+
+  f = fopen (fname, "r");
+  if (!f) {
+    perror (fname);
+    exit (1);
+  }
+  for (line=1;fgets (buf, sizeof (buf), f);line++)
+    compile_line (fname, line, buf);
+  fclose (f);
+}
+
+
+// Run one frame of all effects into frames[].
+static void eval (unsigned char frames[][UNIV_NSLOTS])
+{
+  struct fx_ins *in;
+  uint32_t ph;
+  int i, w;
+
+  for (i=0;i<nins;i++) {
+    in = &ins[i];
+    ph = in->phase;
+    in->phase += in->rate;
+    switch (in->op) {
+    case FX_SINE:     w = sine[ph >> 24];break;
+    case FX_SAW:      w = ph >> 24;break;
+    case FX_TRIANGLE: w = (ph >> 23) ^ ((int32_t) ph >> 31);break;
+    case FX_SQUARE:   w = (ph >> 24) < in->param ? 255 : 0;break;
+    case FX_RAINBOW:  w = rainbow[(uint8_t) ((ph >> 24) - in->param)];break;
+    case FX_RANDOM:
+      // A new value every period.
+      if (in->phase < ph) in->val = random ();
+      w = in->val;
+      break;
+    default:          w = 0;break;
+    }
+    frames[in->univ][in->slot] = in->min + ((w & 0xff) * (in->range + 1) >> 8);
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  static unsigned char frames[MAXUNIV][UNIV_NSLOTS];
+  uint64_t next, t0, dt, total = 0, worst = 0, nextreport;
+  int nonoptions, i, nframes = 0, over = 0;
+
+  nonoptions = parse_opts(argc, argv);
+  if ((argc - nonoptions < 2) || (argc - nonoptions - 1 > MAXUNIV))
+    print_usage (argv[0]);
+
+  for (i=nonoptions+1;i<argc;i++)
+    univ[numuniv++] = univ_open (argv[i]);
+  make_tables ();
+  compile (argv[nonoptions]);
+  if (verbose)
+    fprintf (stderr, "%d channels with effects in %d universes.\n", nins, numuniv);
+
+  next = univ_time_ns ();
+  nextreport = next + 1000000000ULL;
+  while (1) {
+    univ_sleep_until (next);
+    next += interval * 1000ULL;
+
+    t0 = univ_time_ns ();
+    // Start from what's there: channels without an effect stay as
+    // others have set them.
+    for (i=0;i<numuniv;i++)
+      memcpy (frames[i], univ[i]->data, UNIV_NSLOTS);
+    eval (frames);
+    for (i=0;i<numuniv;i++)
+      univ_write (univ[i], 0, frames[i], UNIV_NSLOTS);
+    dt = univ_time_ns () - t0;
+
+    nframes++;
+    total += dt;
+    if (dt > worst) worst = dt;
+    if (budget && (dt > budget * 1000ULL)) over++;
+    if (verbose && (t0 > nextreport)) {
+      fprintf (stderr, "eval: %.1f us avg, %.1f us max, %d of %d frames over budget  \r",
+               total / 1e3 / nframes, worst / 1e3, over, nframes);
+      nextreport += 1000000000ULL;
+      total = worst = nframes = over = 0;
+    }
+  }
+
+  exit(EXIT_SUCCESS);
+}
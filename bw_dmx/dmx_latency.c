@@ -0,0 +1,284 @@
+/*
+ * dmx_latency.c
+ *
+ * Report how long updates of universes take to get out. The output
+ * drivers leave a trace in the universe header for every update they
+ * send (see universe.h); this collects them and prints, per universe
+ * and output, histograms of:
+ *
+ *   pickup  from the commit of an update to the driver taking it:
+ *           time spent waiting for the next frame, or in polling
+ *   send    from there to the last slot going to the hardware
+ *   total   the two together
+ *
+ * When several commits go out in one frame, the first of them counts:
+ * the update that waited longest. (After more than UNIV_COMMITLEN
+ * commits in a frame the oldest that is still known counts, which
+ * makes pickup come out short.) Commits that are overwritten before
+ * any frame carries them are not counted at all.
+ *
+ * A report is printed every -i seconds, and when interrupted.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+
+#include "universe.h"
+
+#define MAXUNIV  64
+#define NSTAGE   (UNIV_STAGE_SACN + 1)
+#define NBUCKET  25                 // bucket b: less than 2^b us
+
+enum { SEG_PICKUP, SEG_SEND, SEG_TOTAL, NSEG };
+
+static const char *stagename[NSTAGE] = { "?", "spi", "uart", "udp", "sacn" };
+static const char *segname[NSEG] = { "pickup", "send", "total" };
+
+struct stats {
+  uint64_t n;
+  uint32_t pid;                     // of the driver
+  uint64_t count[NSEG][NBUCKET];
+  uint64_t sum[NSEG], max[NSEG];    // ns
+};
+
+struct watched {
+  struct universe *univ;
+  uint32_t next;                    // the next trace to read
+  uint32_t lost;                    // overwritten before we saw them
+  struct stats st[NSTAGE];
+};
+
+static struct watched watched[MAXUNIV];
+static int numwatched;
+
+static int interval = 10;
+static int poll_ms = 50;
+
+static volatile int stop;
+
+
+static void print_usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-ip] univfile ...\n", prog);
+  fputs("  -i --interval  seconds between reports (default 10)\n"
+        "  -p --poll      read the traces this often (msec, default 50)\n", stderr);
+  exit(EXIT_FAILURE);
+}
+
+static const struct option lopts[] = {
+  { "interval",  1, 0, 'i' },
+  { "poll",      1, 0, 'p' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
+
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "i:p:", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'i':interval = atoi (optarg);break;
+    case 'p':poll_ms = atoi (optarg);break;
+    default: print_usage (argv[0]);break;
+    }
+  }
+  return optind;
+}
+
+
+static void handle_stop (int sig)
+{
+  stop = 1;
+}
+
+
+static void add (struct stats *st, int seg, uint64_t ns)
+{
+  uint64_t us = ns / 1000;
+  int b = 0;
+
+  while ((b < NBUCKET-1) && (us >= (1ULL << b))) b++;
+  st->count[seg][b]++;
+  st->sum[seg] += ns;
+  if (ns > st->max[seg]) st->max[seg] = ns;
+}
+
+
+static void add_trace (struct watched *w, struct univ_trace *tr)
+{
+  struct stats *st;
+  uint64_t pickup, send;
+
+  if (tr->stage >= NSTAGE) return;
+  st = &w->st[tr->stage];
+  // A commit that overtook the read of gen can look later than the take.
+  pickup = (tr->taken > tr->commit) ? tr->taken - tr->commit : 0;
+  send = (tr->shipped > tr->taken) ? tr->shipped - tr->taken : 0;
+  add (st, SEG_PICKUP, pickup);
+  add (st, SEG_SEND, send);
+  add (st, SEG_TOTAL, pickup + send);
+  st->pid = tr->pid;
+  st->n++;
+}
+
+
+/*
+ * Take in the traces written since the last look. A trace that is
+ * still being written is left for the next time; one that has been
+ * overwritten by a newer one is lost.
+ */
+static void read_traces (struct watched *w)
+{
+  struct univ_hdr *h = w->univ->hdr;
+  struct univ_trace tr, *p;
+  uint32_t head, seq;
+
+  head = __atomic_load_n (&h->trace_head, __ATOMIC_ACQUIRE);
+  if (head - w->next > UNIV_TRACELEN) {
+    w->lost += head - UNIV_TRACELEN - w->next;
+    w->next = head - UNIV_TRACELEN;
+  }
+  while (w->next != head) {
+    p = &h->trace[w->next % UNIV_TRACELEN];
+    seq = __atomic_load_n (&p->seq, __ATOMIC_ACQUIRE);
+    if ((int32_t) (seq - (w->next + 1)) < 0)
+      return;
+    memcpy (&tr, p, sizeof (tr));
+    if ((seq == w->next + 1) &&
+        (__atomic_load_n (&p->seq, __ATOMIC_ACQUIRE) == seq))
+      add_trace (w, &tr);
+    else
+      w->lost++;
+    w->next++;
+  }
+}
+
+
+// The upper bound of the bucket that holds the fraction f of the updates.
+static double percentile (uint64_t *count, uint64_t n, double f)
+{
+  uint64_t sum = 0;
+  int b;
+
+  for (b=0;b<NBUCKET;b++) {
+    sum += count[b];
+    if (sum >= f * n) break;
+  }
+  return (1ULL << b) / 1000.0;
+}
+
+
+static void print_stats (struct watched *w, int stage)
+{
+  struct stats *st = &w->st[stage];
+  int b, s, first, last;
+
+  printf ("%s %s (pid %u): %llu updates\n", w->univ->name, stagename[stage],
+          st->pid, (unsigned long long) st->n);
+  printf ("%10s", "ms");
+  for (s=0;s<NSEG;s++) printf ("%10s", segname[s]);
+  printf ("\n%10s", "mean");
+  for (s=0;s<NSEG;s++) printf ("%10.3f", st->sum[s] / 1e6 / st->n);
+  printf ("\n%10s", "p50 <");
+  for (s=0;s<NSEG;s++) printf ("%10.3f", percentile (st->count[s], st->n, 0.50));
+  printf ("\n%10s", "p99 <");
+  for (s=0;s<NSEG;s++) printf ("%10.3f", percentile (st->count[s], st->n, 0.99));
+  printf ("\n%10s", "max");
+  for (s=0;s<NSEG;s++) printf ("%10.3f", st->max[s] / 1e6);
+  printf ("\n");
+
+  // The histogram, from the first to the last bucket in use.
+  first = NBUCKET;
+  last = 0;
+  for (s=0;s<NSEG;s++)
+    for (b=0;b<NBUCKET;b++)
+      if (st->count[s][b]) {
+        if (b < first) first = b;
+        if (b > last) last = b;
+      }
+  for (b=first;b<=last;b++) {
+    printf ("%8.3f <", (1ULL << b) / 1000.0);
+    for (s=0;s<NSEG;s++)
+      printf ("%10llu", (unsigned long long) st->count[s][b]);
+    printf ("\n");
+  }
+}
+
+
+static void report (void)
+{
+  struct watched *w;
+  int i, stage, none;
+
+  for (i=0;i<numwatched;i++) {
+    w = &watched[i];
+    none = 1;
+    for (stage=1;stage<NSTAGE;stage++) {
+      if (!w->st[stage].n) continue;
+      print_stats (w, stage);
+      none = 0;
+    }
+    if (none)
+      printf ("%s: no updates went out\n", w->univ->name);
+    if (w->lost)
+      printf ("%s: %u traces lost, poll faster\n", w->univ->name, w->lost);
+    printf ("\n");
+  }
+  fflush (stdout);
+}
+
+
+int main (int argc, char **argv)
+{
+  struct watched *w;
+  uint64_t now, nextreport;
+  int i, nonoptions;
+
+  nonoptions = parse_opts (argc, argv);
+  if (nonoptions == argc)
+    print_usage (argv[0]);
+  for (i=nonoptions;i<argc;i++) {
+    if (numwatched >= MAXUNIV) {
+      fprintf (stderr, "too many universes (max %d)\n", MAXUNIV);
+      exit (1);
+    }
+    w = &watched[numwatched++];
+    w->univ = univ_open (argv[i]);
+    // Only what happens from now on.
+    w->next = w->univ->hdr->trace_head;
+  }
+
+  signal (SIGINT, handle_stop);
+  signal (SIGTERM, handle_stop);
+
+  nextreport = univ_time_ns () + interval * 1000000000ULL;
+  while (!stop) {
+    usleep (poll_ms * 1000);
+    for (i=0;i<numwatched;i++)
+      read_traces (&watched[i]);
+    now = univ_time_ns ();
+    if (now >= nextreport) {
+      report ();
+      nextreport += interval * 1000000000ULL;
+    }
+  }
+  report ();
+  exit (0);
+}
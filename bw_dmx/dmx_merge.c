@@ -0,0 +1,235 @@
+/*
+ * dmx_merge.c
+ *
+ * Merge several universe files into one. Each frame tick every output
+ * channel gets either the highest value any source has for it (HTP,
+ * the default), or the value of the source that changed it last (LTP,
+ * for the channels given with -l).
+ *
+ * HTP is a max over all sources, 16 channels at a time. For LTP each
+ * source remembers when each of its channels last changed; the newest
+ * change wins. With -t a source that shows no sign of life for that
+ * long drops out of the merge until it does again.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "universe.h"
+
+#define MAXSRC   64
+#define NCHAN    (UNIV_NSLOTS - 1)
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef unsigned char v16u8 __attribute__ ((vector_size (16)));
+
+struct source {
+  struct universe *univ;
+  int alive;
+  uint32_t gen;                     // header fields seen last tick
+  uint64_t rx_time;
+  uint64_t active;                  // when we last saw it do something
+  unsigned char shadow[NCHAN];      // channels as of the last tick
+  uint64_t changed[NCHAN];          // when each channel last changed
+};
+
+static struct source src[MAXSRC];
+static int numsrc;
+
+static unsigned char ltp[NCHAN];    // 1: this channel is LTP
+static int nltp;
+
+static char *outname = "dmxdata";
+static int interval = 22727;        // 44 Hz
+static int timeout = 0;             // ms, 0: sources never time out
+
+
+static void print_usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-oilt] source ...\n", prog);
+  fputs("  -o --output   universe file to write (default dmxdata)\n"
+        "  -i --interval frame interval (usec, default 22727: 44 Hz)\n"
+        "  -l --ltp      channels to merge LTP, e.g. 0-15,32 (may repeat)\n"
+        "  -t --timeout  drop sources that are idle this long (ms)\n", stderr);
+  exit(EXIT_FAILURE);
+}
+
+static const struct option lopts[] = {
+  { "output",    1, 0, 'o' },
+  { "interval",  1, 0, 'i' },
+  { "ltp",       1, 0, 'l' },
+  { "timeout",   1, 0, 't' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
+
+
+// Channels are numbered as set_dmx does: 0 is the first one.
+static void add_ltp (char *list)
+{
+  char *p = list;
+  int a, b, i;
+
+  while (*p) {
+    a = b = strtol (p, &p, 0);
+    if (*p == '-')
+      b = strtol (p+1, &p, 0);
+    if ((a < 0) || (b >= NCHAN) || (a > b)) {
+      fprintf (stderr, "%s: bad channel range\n", list);
+      exit (1);
+    }
+    for (i=a;i<=b;i++)
+      ltp[i] = 1;
+    if (*p == ',') p++;
+    else if (*p) {
+      fprintf (stderr, "%s: bad channel list\n", list);
+      exit (1);
+    }
+  }
+  for (nltp=0, i=0;i<NCHAN;i++)
+    nltp += ltp[i];
+}
+
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "o:i:l:t:", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'o':outname = optarg;break;
+    case 'i':interval = atoi (optarg);break;
+    case 'l':add_ltp (optarg);break;
+    case 't':timeout = atoi (optarg);break;
+    default: print_usage (argv[0]);break;
+    }
+  }
+  return optind;
+}
+
+
+/*
+ * Note which channels of s changed since the last tick, and whether
+ * the source is still alive. A source is active when its data or its
+ * generation count changes, or when its receiver got a frame:
+ * dmx_netrx and bw_dmx keep rx_time going even if the data is static.
+ */
+static void scan_source (struct source *s, uint64_t now)
+{
+  // Room for every run, so a range never stretches over channels that
+  // didn't change.
+  struct univ_range r[UNIV_NSLOTS / 2 + 1];
+  struct univ_hdr *h = s->univ->hdr;
+  int i, j, n;
+
+  n = univ_diff (s->shadow, s->univ->data + 1, NCHAN, r, ARRAY_SIZE (r));
+  for (i=0;i<n;i++) {
+    memcpy (s->shadow + r[i].start, s->univ->data + 1 + r[i].start, r[i].len);
+    for (j=r[i].start;j<r[i].start + r[i].len;j++)
+      s->changed[j] = now;
+  }
+
+  if (n || (h->gen != s->gen) || (h->rx_time != s->rx_time)) {
+    s->active = now;
+    s->gen = h->gen;
+    s->rx_time = h->rx_time;
+  }
+  s->alive = !timeout || (now - s->active < timeout * 1000000ULL);
+}
+
+
+// out = max (out, in), 16 channels at a time.
+static void htp_max (unsigned char *out, unsigned char *in)
+{
+  v16u8 a, b, m;
+  int i;
+
+  for (i=0;i<NCHAN;i+=16) {
+    memcpy (&a, out + i, 16);
+    memcpy (&b, in + i, 16);
+    m = (v16u8) (b > a);
+    a = (a & ~m) | (b & m);
+    memcpy (out + i, &a, 16);
+  }
+}
+
+
+static void merge (unsigned char *out)
+{
+  uint64_t newest;
+  int i, c, best;
+
+  memset (out, 0, NCHAN);
+  for (i=0;i<numsrc;i++)
+    if (src[i].alive)
+      htp_max (out, src[i].shadow);
+
+  if (!nltp) return;
+  for (c=0;c<NCHAN;c++) {
+    if (!ltp[c]) continue;
+    best = -1;
+    newest = 0;
+    for (i=0;i<numsrc;i++) {
+      if (!src[i].alive) continue;
+      if ((best < 0) || (src[i].changed[c] > newest)) {
+        best = i;
+        newest = src[i].changed[c];
+      }
+    }
+    out[c] = (best < 0) ? 0 : src[best].shadow[c];
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  struct universe *out;
+  unsigned char frame[NCHAN];
+  uint64_t now, next;
+  int nonoptions, i;
+
+  nonoptions = parse_opts(argc, argv);
+  if (nonoptions >= argc)
+    print_usage (argv[0]);
+  if (argc - nonoptions > MAXSRC) {
+    fprintf (stderr, "too many sources (max %d)\n", MAXSRC);
+    exit (1);
+  }
+
+  out = univ_open (outname);
+  now = univ_time_ns ();
+  for (i=nonoptions;i<argc;i++) {
+    src[numsrc].univ = univ_open (argv[i]);
+    src[numsrc].active = now;
+    numsrc++;
+  }
+
+  next = now;
+  while (1) {
+    univ_sleep_until (next);
+    next += interval * 1000ULL;
+    now = univ_time_ns ();
+
+    for (i=0;i<numsrc;i++)
+      scan_source (&src[i], now);
+    merge (frame);
+    // Only what changed is written, so the output driver can tell.
+    univ_write (out, 1, frame, NCHAN);
+  }
+
+  exit(EXIT_SUCCESS);
+}
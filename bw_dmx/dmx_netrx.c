@@ -0,0 +1,496 @@
+/*
+ * dmx_netrx.c
+ *
+ * Receive Art-Net and E1.31 (sACN) and write the universes into
+ * universe files. Together with bw_dmx, which sends straight out of
+ * those files, this makes a pi with a DMX board a network DMX node.
+ *
+ * Packets are fetched with recvmmsg, a burst at a time, and only the
+ * channels that changed are copied into the universe. Packets that
+ * arrive late or twice (going by their sequence number) are dropped,
+ * as are E1.31 packets from a source with a lower priority than the
+ * one we're listening to.
+ *
+ * Ranges of network universes can go straight into the arena of
+ * dmx_server: "artnet:0-299:@0" receives 300 universes into @0-@299.
+ *
+ * A channel of a received universe can trigger presets (-t): when its
+ * value changes to v, preset base+v of the bank (-p) is recalled into
+ * the file. A value of 0 recalls nothing.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#define _GNU_SOURCE   // for recvmmsg
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <poll.h>
+
+#include "universe.h"
+#include "dmxnet.h"
+#include "preset.h"
+
+#define MAXUNIV    4096
+#define BURST      32
+#define PKTSIZE    700
+
+#define MAXTRIG    64
+
+#define ARTNET_MAXUNIV  32768
+#define E131_MAXUNIV    64000
+
+// A source that has been quiet this long no longer outranks others.
+#define SOURCE_TIMEOUT 2500000000ULL
+
+enum { PROTO_ARTNET, PROTO_E131 };
+
+struct rx_univ {
+  struct universe *univ;
+  int proto;
+  int netuniv;
+  int seq;                           // -1: nothing received yet
+  int priority;
+  unsigned char cid[E131_CIDLEN];    // the source we listen to
+};
+
+static struct rx_univ univ[MAXUNIV];
+static int numuniv;
+
+// network universe number -> index in univ[], or -1
+static short artmap[ARTNET_MAXUNIV];
+static short e131map[E131_MAXUNIV];
+
+struct trigger {
+  char *arg;                         // proto:universe:channel:file[:base]
+  struct rx_univ *ru;
+  int chan, base, last;
+  struct universe *target;
+};
+
+static struct trigger trig[MAXTRIG];
+static int numtrig;
+
+static char *bankname = "presets";
+static struct preset_bank *bank;
+
+static char *ifaddr = NULL;
+static int debug = 0;
+
+
+static void pabort(const char *s)
+{
+  perror(s);
+  exit(1);
+}
+
+
+static void print_usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-IV] artnet:universe:file | sacn:universe:file ...\n"
+          "       %s [-IV] artnet:first-last:@N | sacn:first-last:@N ...\n", prog, prog);
+  fputs("  -I --iface    address of the interface to receive multicast on\n"
+        "  -t --trigger  proto:universe:channel:file[:base]: recall the preset\n"
+        "                that channel says into file\n"
+        "  -p --presets  preset bank for -t (default presets)\n"
+        "  -V --verbose  print packets that are rejected\n", stderr);
+  exit(EXIT_FAILURE);
+}
+
+static const struct option lopts[] = {
+  { "iface",     1, 0, 'I' },
+  { "trigger",   1, 0, 't' },
+  { "presets",   1, 0, 'p' },
+  { "verbose",   0, 0, 'V' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
+
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "I:t:p:V", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'I':ifaddr = optarg;break;
+    case 't':
+      if (numtrig >= MAXTRIG) {
+        fprintf (stderr, "too many triggers (max %d)\n", MAXTRIG);
+        exit (1);
+      }
+      trig[numtrig++].arg = optarg;
+      break;
+    case 'p':bankname = optarg;break;
+    case 'V':debug = 1;break;
+    default: print_usage (argv[0]);break;
+    }
+  }
+  return optind;
+}
+
+
+static void add_one (char *arg, int proto, int netuniv, char *fname)
+{
+  struct rx_univ *ru;
+
+  if (numuniv >= MAXUNIV) {
+    fprintf (stderr, "too many universes (max %d)\n", MAXUNIV);
+    exit (1);
+  }
+  ru = &univ[numuniv];
+  ru->proto = proto;
+  ru->netuniv = netuniv;
+  if (proto == PROTO_ARTNET) {
+    if ((netuniv < 0) || (netuniv >= ARTNET_MAXUNIV)) {
+      fprintf (stderr, "%s: Art-Net universes are 0-32767\n", arg);
+      exit (1);
+    }
+    artmap[netuniv] = numuniv;
+  } else {
+    if ((netuniv < 1) || (netuniv >= E131_MAXUNIV)) {
+      fprintf (stderr, "%s: E1.31 universes are 1-63999\n", arg);
+      exit (1);
+    }
+    e131map[netuniv] = numuniv;
+  }
+  ru->seq = -1;
+  ru->univ = univ_open (fname);
+  numuniv++;
+}
+
+
+/*
+ * proto:universe:file, or proto:first-last:@N for a range of
+ * universes into consecutive universes of the dmx_server arena.
+ */
+static void add_univ (char *arg)
+{
+  char *p, *q, fname[0x10];
+  int proto, a, b, n, i;
+
+  p = strchr (arg, ':');
+  q = p ? strchr (p+1, ':') : NULL;
+  if (!q) {
+    fprintf (stderr, "%s: should be artnet:universe:file or sacn:universe:file\n", arg);
+    exit (1);
+  }
+  if (strncmp (arg, "artnet:", 7) == 0) {
+    proto = PROTO_ARTNET;
+  } else if (strncmp (arg, "sacn:", 5) == 0) {
+    proto = PROTO_E131;
+  } else {
+    fprintf (stderr, "%s: unknown protocol\n", arg);
+    exit (1);
+  }
+  a = b = strtol (p+1, &p, 0);
+  if (*p == '-') b = strtol (p+1, &p, 0);
+  if ((p != q) || (b < a)) {
+    fprintf (stderr, "%s: bad universe range\n", arg);
+    exit (1);
+  }
+  if (a == b) {
+    add_one (arg, proto, a, q+1);
+    return;
+  }
+  if (q[1] != '@') {
+    fprintf (stderr, "%s: a range of universes goes into the arena (@N)\n", arg);
+    exit (1);
+  }
+  n = atoi (q+2);
+  for (i=a;i<=b;i++) {
+    sprintf (fname, "@%d", n + i - a);
+    add_one (arg, proto, i, fname);
+  }
+}
+
+
+static void bad_trigger (struct trigger *t)
+{
+  fprintf (stderr, "%s: should be proto:universe:channel:file[:base]\n", t->arg);
+  exit (1);
+}
+
+
+// Triggers name a universe we receive, so they are set up after those.
+static void setup_trigger (struct trigger *t)
+{
+  char *p, *q;
+  int i, proto, u;
+
+  if (strncmp (t->arg, "artnet:", 7) == 0)    proto = PROTO_ARTNET;
+  else if (strncmp (t->arg, "sacn:", 5) == 0) proto = PROTO_E131;
+  else bad_trigger (t);
+  p = strchr (t->arg, ':');
+  q = strchr (p+1, ':');
+  if (!q) bad_trigger (t);
+  u = atoi (p+1);
+  t->chan = strtol (q+1, &p, 0);
+  if ((*p != ':') || (t->chan < 0) || (t->chan >= UNIV_NSLOTS - 1))
+    bad_trigger (t);
+  q = strchr (p+1, ':');
+  if (q) {
+    *q++ = 0;
+    t->base = atoi (q);
+  }
+  for (i=0;i<numuniv;i++)
+    if ((univ[i].proto == proto) && (univ[i].netuniv == u))
+      t->ru = &univ[i];
+  if (!t->ru) {
+    fprintf (stderr, "%s: that universe isn't received\n", t->arg);
+    exit (1);
+  }
+  if (!bank) bank = preset_open (bankname);
+  t->target = univ_open (p+1);
+}
+
+
+static void check_triggers (struct rx_univ *ru)
+{
+  struct trigger *t;
+  int i, v;
+
+  for (i=0;i<numtrig;i++) {
+    t = &trig[i];
+    if (t->ru != ru) continue;
+    v = ru->univ->data[1 + t->chan];
+    if (v == t->last) continue;
+    t->last = v;
+    if (v == 0) continue;
+    if (preset_recall (bank, t->base + v, t->target, NULL) < 0) {
+      if (debug) fprintf (stderr, "%s: no preset %d\n", t->arg, t->base + v);
+      continue;
+    }
+    univ_commit (t->target);
+  }
+}
+
+
+static int open_socket (const char *port)
+{
+  struct sockaddr_in sa;
+  int sfd, on = 1, rcvbuf = 1 << 20;
+
+  sfd = socket (AF_INET, SOCK_DGRAM, 0);
+  if (sfd < 0)
+    pabort ("socket");
+  setsockopt (sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+  // Bursts of hundreds of universes should not overflow the socket.
+  setsockopt (sfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (atoi (port));
+  sa.sin_addr.s_addr = htonl (INADDR_ANY);
+  if (bind (sfd, (struct sockaddr *) &sa, sizeof (sa)) < 0)
+    pabort (port);
+  return sfd;
+}
+
+
+static void join_groups (int sfd)
+{
+  struct ip_mreq mreq;
+  char mcast[0x20];
+  int i;
+
+  for (i=0;i<numuniv;i++) {
+    if (univ[i].proto != PROTO_E131) continue;
+    e131_mcast_addr (mcast, univ[i].netuniv);
+    inet_aton (mcast, &mreq.imr_multiaddr);
+    if (ifaddr) inet_aton (ifaddr, &mreq.imr_interface);
+    else        mreq.imr_interface.s_addr = htonl (INADDR_ANY);
+    if (setsockopt (sfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof (mreq)) < 0)
+      perror (mcast);
+  }
+}
+
+
+static void reject (struct rx_univ *ru, const char *why)
+{
+  ru->univ->hdr->rx_rejected++;
+  if (debug)
+    fprintf (stderr, "%s: %s\n", ru->univ->name, why);
+}
+
+
+/*
+ * Sequence numbers: anything up to 20 behind the last one is late or
+ * a duplicate. Further back than that, the sender has restarted.
+ * Returns 0 if the packet should be dropped.
+ */
+static int check_seq (struct rx_univ *ru, int seq)
+{
+  struct univ_hdr *h = ru->univ->hdr;
+  signed char d;
+
+  if ((ru->seq < 0) || (seq == 0 && ru->proto == PROTO_ARTNET)) {
+    ru->seq = seq;
+    return 1;
+  }
+  d = seq - ru->seq;
+  if ((d <= 0) && (d > -20)) {
+    reject (ru, "late or duplicate packet");
+    return 0;
+  }
+  // Art-Net skips 0 when it wraps.
+  if ((d > 1) && !(ru->proto == PROTO_ARTNET && seq == 1 && ru->seq == 255))
+    h->rx_missed += d - 1;
+  ru->seq = seq;
+  return 1;
+}
+
+
+static void store (struct rx_univ *ru, int startcode, unsigned char *data,
+                   int len, uint64_t now)
+{
+  struct univ_hdr *h = ru->univ->hdr;
+
+  if (len > UNIV_NSLOTS - 1) len = UNIV_NSLOTS - 1;
+  h->rx_time = now;
+  h->rx_frames++;
+  if (startcode != 0) {
+    h->rx_altstart++;
+    h->rx_laststart = startcode;
+    return;
+  }
+  if (univ_write (ru->univ, 1, data, len) && numtrig)
+    check_triggers (ru);
+}
+
+
+static void handle_artnet (unsigned char *p, int n, uint64_t now)
+{
+  struct rx_univ *ru;
+  int u, len;
+
+  if ((n < ARTNET_HDRLEN) || memcmp (p, "Art-Net", 8) ||
+      (p[8] != 0x00) || (p[9] != 0x50))
+    return;      // not ArtDmx: polls, syncs etc. are of no interest.
+  u = p[14] | ((p[15] & 0x7f) << 8);
+  if (artmap[u] < 0) return;
+  ru = &univ[artmap[u]];
+
+  len = (p[16] << 8) | p[17];
+  if (len > n - ARTNET_HDRLEN) len = n - ARTNET_HDRLEN;
+  if (!check_seq (ru, p[12])) return;
+  store (ru, 0, p + ARTNET_HDRLEN, len, now);
+}
+
+
+static void handle_e131 (unsigned char *p, int n, uint64_t now)
+{
+  struct rx_univ *ru;
+  struct univ_hdr *h;
+  int u, len, prio;
+
+  if ((n < E131_HDRLEN) || (p[1] != 0x10) || memcmp (p + 4, "ASC-E1.17", 9) ||
+      (p[21] != 0x04) || (p[43] != 0x02) || (p[117] != 0x02) || (p[118] != 0xa1))
+    return;
+  u = (p[113] << 8) | p[114];
+  if ((u >= E131_MAXUNIV) || (e131map[u] < 0)) return;
+  ru = &univ[e131map[u]];
+  h = ru->univ->hdr;
+
+  // Preview data is not for us; a terminated stream has nothing to say.
+  if (p[112] & 0xc0) return;
+
+  // Stick with the source we have unless this one has a higher
+  // priority, or ours has gone quiet.
+  prio = p[108];
+  if (memcmp (ru->cid, p + 22, E131_CIDLEN) != 0) {
+    if ((ru->seq >= 0) && (prio <= ru->priority) &&
+        (now - h->rx_time < SOURCE_TIMEOUT)) {
+      reject (ru, "other source with lower or equal priority");
+      return;
+    }
+    memcpy (ru->cid, p + 22, E131_CIDLEN);
+    ru->seq = -1;
+  }
+  ru->priority = prio;
+
+  if (!check_seq (ru, p[111])) return;
+  len = ((p[123] << 8) | p[124]) - 1;
+  if (len > n - E131_HDRLEN) len = n - E131_HDRLEN;
+  if (len < 0) return;
+  store (ru, p[125], p + E131_HDRLEN, len, now);
+}
+
+
+int main(int argc, char **argv)
+{
+  static unsigned char bufs[BURST][PKTSIZE];
+  struct mmsghdr msgs[BURST];
+  struct iovec iov[BURST];
+  struct pollfd pfd[2];
+  uint64_t now;
+  int nonoptions, i, j, n, nfds = 0, have_art = 0, have_e131 = 0;
+
+  memset (artmap, -1, sizeof (artmap));
+  memset (e131map, -1, sizeof (e131map));
+
+  nonoptions = parse_opts(argc, argv);
+  if (nonoptions >= argc)
+    print_usage (argv[0]);
+  for (i=nonoptions;i<argc;i++)
+    add_univ (argv[i]);
+  for (i=0;i<numtrig;i++)
+    setup_trigger (&trig[i]);
+
+  for (i=0;i<numuniv;i++) {
+    if (univ[i].proto == PROTO_ARTNET) have_art = 1;
+    else                               have_e131 = 1;
+  }
+  if (have_art) {
+    pfd[nfds].fd = open_socket (ARTNET_PORT);
+    pfd[nfds++].events = POLLIN;
+  }
+  if (have_e131) {
+    pfd[nfds].fd = open_socket (E131_PORT);
+    join_groups (pfd[nfds].fd);
+    pfd[nfds++].events = POLLIN;
+  }
+
+  memset (msgs, 0, sizeof (msgs));
+  for (i=0;i<BURST;i++) {
+    iov[i].iov_base = bufs[i];
+    iov[i].iov_len = PKTSIZE;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while (1) {
+    if (poll (pfd, nfds, -1) < 0)
+      continue;
+    for (j=0;j<nfds;j++) {
+      if (!(pfd[j].revents & POLLIN)) continue;
+      // Drain the socket, a burst at a time.
+      do {
+        n = recvmmsg (pfd[j].fd, msgs, BURST, MSG_DONTWAIT, NULL);
+        now = univ_time_ns ();
+        for (i=0;i<n;i++) {
+          if (bufs[i][0] == 'A')
+            handle_artnet (bufs[i], msgs[i].msg_len, now);
+          else
+            handle_e131 (bufs[i], msgs[i].msg_len, now);
+        }
+      } while (n == BURST);
+    }
+  }
+
+  exit(EXIT_SUCCESS);
+}
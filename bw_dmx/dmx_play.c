@@ -0,0 +1,241 @@
+/*
+ * dmx_play.c
+ *
+ * Play back a recording made with dmx_record into universe files.
+ *
+ * Records are applied on an absolute clock, so timing errors don't
+ * add up over a long show. The last bit of each wait is spent
+ * spinning, which keeps playback within a few usec of the recording
+ * at very little CPU cost.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "universe.h"
+#include "dmxrec.h"
+
+// Sleep until this close to the deadline, then spin.
+#define SPINTIME 100000ULL
+
+static int seek_ms = 0;
+static int loop = 0;
+
+static void pabort(const char *s)
+{
+  perror(s);
+  exit(1);
+}
+
+
+static void print_usage(const char *prog)
+{
+  printf("Usage: %s [-sl] recording [univfile ...]\n", prog);
+  puts("  -s --seek   start this far into the recording (msec)\n"
+       "  -l --loop   start over at the end\n"
+       "Without univfiles, the files that were recorded are written.\n"
+  );
+  exit(1);
+}
+
+static const struct option lopts[] = {
+  { "seek",    1, 0, 's' },
+  { "loop",    0, 0, 'l' },
+  { "help",    0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
+
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "s:l", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 's':seek_ms = atoi (optarg);break;
+    case 'l':loop = 1;break;
+    default: print_usage (argv[0]);break;
+    }
+  }
+  return optind;
+}
+
+
+static unsigned char *rec;
+static uint64_t reclen, recend;
+static struct rec_index *idx;
+static uint64_t nindex;
+
+
+/*
+ * Find the key frames. Normally there is an index at the end; if the
+ * recorder didn't get to write it, find them by walking the records.
+ */
+static void load_index (void)
+{
+  struct rec_trailer tr;
+  struct rec_hdr rh;
+  uint64_t off, t, max = 0;
+
+  if (reclen >= sizeof (struct rec_filehdr) + sizeof (tr)) {
+    memcpy (&tr, rec + reclen - sizeof (tr), sizeof (tr));
+    if ((memcmp (tr.magic, REC_IDXMAGIC, sizeof (tr.magic)) == 0) &&
+        (tr.index + tr.nindex * sizeof (*idx) + sizeof (tr) == reclen)) {
+      idx = (struct rec_index *) (rec + tr.index);
+      nindex = tr.nindex;
+      recend = tr.index;
+      return;
+    }
+  }
+
+  fprintf (stderr, "no index, scanning recording.\n");
+  recend = reclen;
+  t = 0;
+  nindex = 0;
+  for (off = sizeof (struct rec_filehdr);
+       off + sizeof (rh) <= reclen;
+       off += sizeof (rh) + rh.len) {
+    memcpy (&rh, rec + off, sizeof (rh));
+    if (off + sizeof (rh) + rh.len > reclen) break;
+    t += rh.dt;
+    if ((rh.type == REC_KEY) && (rh.univ == 0)) {
+      if (nindex == max) {
+        max = max ? 2 * max : 256;
+        idx = realloc (idx, max * sizeof (*idx));
+        if (!idx) pabort ("realloc");
+      }
+      idx[nindex].t = t;
+      idx[nindex].offset = off;
+      nindex++;
+    }
+  }
+  // A record that was cut off halfway is not played.
+  recend = off;
+}
+
+
+static void wait_until (uint64_t t)
+{
+  if (univ_time_ns () + SPINTIME < t)
+    univ_sleep_until (t - SPINTIME);
+  while (univ_time_ns () < t)
+    ;
+}
+
+
+static void apply (struct universe *u, struct rec_hdr *rh, unsigned char *p)
+{
+  struct rec_range rr;
+  int off;
+
+  if (rh->type == REC_KEY) {
+    univ_write (u, 0, p, rh->len < UNIV_NSLOTS ? rh->len : UNIV_NSLOTS);
+    return;
+  }
+
+  for (off = 0; off + sizeof (rr) <= rh->len; off += sizeof (rr) + rr.len) {
+    memcpy (&rr, p + off, sizeof (rr));
+    if ((rr.start + rr.len > UNIV_NSLOTS) ||
+        (off + sizeof (rr) + rr.len > rh->len))
+      break;
+    memcpy (u->data + rr.start, p + off + sizeof (rr), rr.len);
+    univ_mark (u, rr.start, rr.len);
+  }
+  univ_commit (u);
+}
+
+
+int main (int argc, char **argv)
+{
+  struct rec_filehdr *fh;
+  struct rec_hdr rh;
+  struct universe *univ[REC_MAXUNIV];
+  struct stat statb;
+  uint64_t off, t, t0, start, i, from;
+  int nonoptions, fd, u, first;
+
+  nonoptions = parse_opts(argc, argv);
+  if (nonoptions >= argc)
+    print_usage (argv[0]);
+
+  fd = open (argv[nonoptions], O_RDONLY);
+  if ((fd < 0) || (fstat (fd, &statb) < 0))
+    pabort (argv[nonoptions]);
+  reclen = statb.st_size;
+  if (reclen < sizeof (*fh)) {
+    fprintf (stderr, "%s: not a DMX recording\n", argv[nonoptions]);
+    exit (1);
+  }
+  rec = mmap (NULL, reclen, PROT_READ, MAP_SHARED, fd, 0);
+  if (rec == MAP_FAILED)
+    pabort ("mmap");
+
+  fh = (struct rec_filehdr *) rec;
+  if ((memcmp (fh->magic, REC_MAGIC, sizeof (fh->magic)) != 0) ||
+      (fh->nuniv > REC_MAXUNIV)) {
+    fprintf (stderr, "%s: not a DMX recording\n", argv[nonoptions]);
+    exit (1);
+  }
+
+  for (u=0;u<fh->nuniv;u++) {
+    if (nonoptions + 1 + u < argc)
+      univ[u] = univ_open (argv[nonoptions + 1 + u]);
+    else
+      univ[u] = univ_open (fh->names[u]);
+  }
+
+  load_index ();
+  if (!nindex) {
+    fprintf (stderr, "%s: no key frames\n", argv[nonoptions]);
+    exit (1);
+  }
+
+  // Start at the last key frame at or before the seek position.
+  from = seek_ms * 1000ULL;
+  for (i=0;(i+1 < nindex) && (idx[i+1].t <= from);i++)
+    ;
+
+  do {
+    off = idx[i].offset;
+    t = idx[i].t;
+    // What comes before the seek position is applied right away.
+    t0 = (from > t) ? from : t;
+    start = univ_time_ns ();
+    first = 1;
+    while (off + sizeof (rh) <= recend) {
+      memcpy (&rh, rec + off, sizeof (rh));
+      if (off + sizeof (rh) + rh.len > recend) break;
+      // The first record's dt counts from before where we started.
+      if (!first) t += rh.dt;
+      first = 0;
+
+      if (rh.univ < fh->nuniv) {
+        if (t > t0)
+          wait_until (start + (t - t0) * 1000);
+        apply (univ[rh.univ], &rh, rec + off + sizeof (rh));
+      }
+      off += sizeof (rh) + rh.len;
+    }
+    i = 0;
+    from = 0;
+  } while (loop);
+
+  exit (0);
+}
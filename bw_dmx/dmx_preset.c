@@ -0,0 +1,130 @@
+/*
+ * dmx_preset.c
+ *
+ * Manage a preset bank:
+ *
+ *   dmx_preset [-p bank] list
+ *   dmx_preset [-p bank] capture N file [name]
+ *   dmx_preset [-p bank] recall N file [a-b,c,...]
+ *   dmx_preset [-p bank] clear N
+ *
+ * The bank is created when it doesn't exist. Presets can also be
+ * captured and recalled by set_dmx, also on its stdin, and recalled
+ * from the network by dmx_netrx (-t).
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "universe.h"
+#include "preset.h"
+
+static char *bankname = "presets";
+
+
+static void print_usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-p bank] list | capture N file [name] |\n"
+          "              recall N file [channels] | clear N\n", prog);
+  fputs("  -p --presets  preset bank (default presets)\n", stderr);
+  exit(EXIT_FAILURE);
+}
+
+static const struct option lopts[] = {
+  { "presets",   1, 0, 'p' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
+
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "p:", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'p':bankname = optarg;break;
+    default: print_usage (argv[0]);break;
+    }
+  }
+  return optind;
+}
+
+
+static void list (struct preset_bank *b)
+{
+  struct preset_entry *e;
+  char when[0x40];
+  time_t t;
+  int i;
+
+  for (i=0;i<b->hdr->count;i++) {
+    e = &b->hdr->index[i];
+    if (!e->used) continue;
+    t = e->time / 1000000;
+    strftime (when, sizeof (when), "%Y-%m-%d %H:%M:%S", localtime (&t));
+    printf ("%5d  %-*s  %s\n", i, PRESET_NAMELEN, e->name, when);
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  static unsigned char mask[UNIV_NSLOTS];
+  struct preset_bank *b;
+  struct universe *u;
+  char **av;
+  int ac, n;
+
+  n = parse_opts(argc, argv);
+  av = argv + n;
+  ac = argc - n;
+  if (ac < 1)
+    print_usage (argv[0]);
+  b = preset_open (bankname);
+
+  if ((strcmp (av[0], "list") == 0) && (ac == 1)) {
+    list (b);
+  } else if ((strcmp (av[0], "capture") == 0) && ((ac == 3) || (ac == 4))) {
+    u = univ_open (av[2]);
+    if (preset_capture (b, atoi (av[1]), u, (ac == 4) ? av[3] : NULL) < 0) {
+      fprintf (stderr, "%s: no such preset\n", av[1]);
+      exit (1);
+    }
+  } else if ((strcmp (av[0], "recall") == 0) && ((ac == 3) || (ac == 4))) {
+    u = univ_open (av[2]);
+    if ((ac == 4) && (preset_mask (av[3], mask) < 0)) {
+      fprintf (stderr, "%s: bad channels\n", av[3]);
+      exit (1);
+    }
+    if (preset_recall (b, atoi (av[1]), u, (ac == 4) ? mask : NULL) < 0) {
+      fprintf (stderr, "%s: no such preset\n", av[1]);
+      exit (1);
+    }
+    univ_commit (u);
+  } else if ((strcmp (av[0], "clear") == 0) && (ac == 2)) {
+    n = atoi (av[1]);
+    if ((n < 0) || (n >= b->hdr->count)) {
+      fprintf (stderr, "%s: no such preset\n", av[1]);
+      exit (1);
+    }
+    b->hdr->index[n].used = 0;
+  } else {
+    print_usage (argv[0]);
+  }
+  exit(EXIT_SUCCESS);
+}
@@ -7,34 +7,21 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 
-char *open_dmx (char *fname)
-{
-  int infd; 
-  char *data;
-
-  infd = open (fname, O_RDWR); 
-  if (infd < 0) {
-    perror (fname);
-    exit (1);
-  }
-
-  data = mmap (NULL, 0x201, PROT_READ | PROT_WRITE, MAP_SHARED, infd, 0);
-  if (data == NULL) {
-    perror ("mmap");
-    exit (1);
-  }
-  return data;
-}
+#include "universe.h"
 
 int main (int argc, char **argv) 
 {
-  char *dmxdata;
+  struct universe *univ;
+  unsigned char *dmxdata;
 
-  dmxdata = open_dmx ("dmxdata");
+  univ = univ_open ("dmxdata");
+  dmxdata = univ->data;
 
   while (1) {
     for (int i=0;i<64;i++)
       dmxdata[1+i] = random ();
+    univ_mark (univ, 1, 64);
+    univ_commit (univ);
     usleep (25000);
   }
   exit (0);
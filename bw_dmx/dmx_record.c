@@ -0,0 +1,219 @@
+/*
+ * dmx_record.c
+ *
+ * Record what happens in one or more universe files, for example the
+ * one bw_dmx -r receives into, for later playback with dmx_play.
+ *
+ * Only the channels that change are stored, with a full key frame of
+ * every universe every few seconds so that playback can start
+ * anywhere. See dmxrec.h for the format.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "universe.h"
+#include "dmxrec.h"
+
+#define MAXRANGES 64
+
+static int poll_us = 2000;
+static int keyint = 10000;
+
+static volatile int stop;
+
+static void pabort(const char *s)
+{
+  perror(s);
+  exit(1);
+}
+
+
+static void print_usage(const char *prog)
+{
+  printf("Usage: %s [-ik] recording univfile ...\n", prog);
+  puts("  -i --interval  look for changes this often (usec, default 2000)\n"
+       "  -k --keyint    key frame interval (msec, default 10000)\n"
+  );
+  exit(1);
+}
+
+static const struct option lopts[] = {
+  { "interval",  1, 0, 'i' },
+  { "keyint",    1, 0, 'k' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
+
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "i:k:", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'i':poll_us = atoi (optarg);break;
+    case 'k':keyint = atoi (optarg);break;
+    default: print_usage (argv[0]);break;
+    }
+  }
+  return optind;
+}
+
+
+static void handle_stop (int sig)
+{
+  stop = 1;
+}
+
+
+static uint64_t lastt;
+
+static void put_record (FILE *f, uint64_t t, int u, int type,
+                        unsigned char *buf, int len)
+{
+  struct rec_hdr rh;
+
+  rh.dt = t - lastt;
+  rh.univ = u;
+  rh.type = type;
+  rh.len = len;
+  lastt = t;
+  if ((fwrite (&rh, sizeof (rh), 1, f) != 1) ||
+      (fwrite (buf, 1, len, f) != len))
+    pabort ("write");
+}
+
+
+/*
+ * Store the slots of u that differ from the shadow copy as a delta
+ * record, and bring the shadow up to date from what was stored.
+ */
+static void put_delta (FILE *f, uint64_t t, int un, struct universe *u,
+                       unsigned char *shadow)
+{
+  struct univ_range r[MAXRANGES];
+  unsigned char buf[MAXRANGES * sizeof (struct rec_range) + UNIV_NSLOTS];
+  struct rec_range rr;
+  int i, n, len;
+
+  n = univ_diff (shadow, u->data, UNIV_NSLOTS, r, MAXRANGES);
+  if (!n) return;
+
+  len = 0;
+  for (i=0;i<n;i++) {
+    rr.start = r[i].start;
+    rr.len = r[i].len;
+    memcpy (buf + len, &rr, sizeof (rr));
+    len += sizeof (rr);
+    // Copy once: what goes into the file is what goes into the shadow.
+    memcpy (buf + len, u->data + rr.start, rr.len);
+    memcpy (shadow + rr.start, buf + len, rr.len);
+    len += rr.len;
+  }
+  put_record (f, t, un, REC_DELTA, buf, len);
+}
+
+
+int main (int argc, char **argv)
+{
+  struct rec_filehdr fh;
+  struct rec_trailer tr;
+  struct rec_index *idx = NULL;
+  struct universe *univ[REC_MAXUNIV];
+  unsigned char shadow[REC_MAXUNIV][UNIV_NSLOTS];
+  int nindex = 0, maxindex = 0;
+  int nonoptions, i, u, nuniv;
+  uint64_t start, next, t, nextkey;
+  struct timeval tv;
+  FILE *f;
+
+  nonoptions = parse_opts(argc, argv);
+  if (argc - nonoptions < 2)
+    print_usage (argv[0]);
+
+  nuniv = argc - nonoptions - 1;
+  if (nuniv > REC_MAXUNIV) {
+    fprintf (stderr, "at most %d universes\n", REC_MAXUNIV);
+    exit (1);
+  }
+
+  memset (&fh, 0, sizeof (fh));
+  memcpy (fh.magic, REC_MAGIC, sizeof (fh.magic));
+  fh.nuniv = nuniv;
+  fh.keyint = keyint;
+  gettimeofday (&tv, NULL);
+  fh.start = tv.tv_sec * 1000000ULL + tv.tv_usec;
+  for (u=0;u<nuniv;u++) {
+    univ[u] = univ_open (argv[nonoptions + 1 + u]);
+    strncpy (fh.names[u], univ[u]->name, REC_NAMELEN-1);
+  }
+
+  f = fopen (argv[nonoptions], "w");
+  if (!f) pabort (argv[nonoptions]);
+  // Hours of recording on an SD card: write in big blocks.
+  setvbuf (f, NULL, _IOFBF, 0x10000);
+  if (fwrite (&fh, sizeof (fh), 1, f) != 1)
+    pabort ("write");
+
+  signal (SIGINT, handle_stop);
+  signal (SIGTERM, handle_stop);
+  signal (SIGHUP, handle_stop);
+
+  start = next = univ_time_ns ();
+  nextkey = 0;
+  while (!stop) {
+    univ_sleep_until (next);
+    next += poll_us * 1000ULL;
+    t = (univ_time_ns () - start) / 1000;
+
+    if (t >= nextkey) {
+      if (nindex == maxindex) {
+        maxindex = maxindex ? 2 * maxindex : 256;
+        idx = realloc (idx, maxindex * sizeof (*idx));
+        if (!idx) pabort ("realloc");
+      }
+      idx[nindex].t = t;
+      idx[nindex].offset = ftello (f);
+      nindex++;
+      for (u=0;u<nuniv;u++) {
+        memcpy (shadow[u], univ[u]->data, UNIV_NSLOTS);
+        put_record (f, t, u, REC_KEY, shadow[u], UNIV_NSLOTS);
+      }
+      nextkey += keyint * 1000ULL;
+      continue;
+    }
+
+    for (u=0;u<nuniv;u++)
+      put_delta (f, t, u, univ[u], shadow[u]);
+  }
+
+  // The index goes at the end. Without it dmx_play scans the file.
+  tr.index = ftello (f);
+  tr.nindex = nindex;
+  memcpy (tr.magic, REC_IDXMAGIC, sizeof (tr.magic));
+  for (i=0;i<nindex;i++)
+    if (fwrite (&idx[i], sizeof (idx[i]), 1, f) != 1)
+      pabort ("write");
+  if (fwrite (&tr, sizeof (tr), 1, f) != 1)
+    pabort ("write");
+  if (fclose (f))
+    pabort ("close");
+  exit (0);
+}
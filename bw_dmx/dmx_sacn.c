@@ -0,0 +1,388 @@
+/*
+ * dmx_sacn.c
+ *
+ * Send universe files out as E1.31 (streaming ACN).
+ *
+ * Each file is mapped to an E1.31 universe and sent to that universe's
+ * multicast group, or to a list of hosts given with -h. All packets of
+ * one frame tick are handed to the kernel in a single sendmmsg, with
+ * the channel data taken straight from the mapped file. The packet
+ * headers are built once; per frame only the sequence number changes.
+ *
+ * -B runs a benchmark instead: it sends all universes back-to-back
+ * for the given number of seconds and reports packets per second and
+ * CPU use. Use it with -h 127.0.0.1 to measure against loopback.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#define _GNU_SOURCE   // for sendmmsg
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "universe.h"
+#include "dmxnet.h"
+#include "rt.h"
+
+#define MAXUNIV  4096
+#define MAXHOSTS 8
+#define MAXBATCH 1024   // the kernel takes at most UIO_MAXIOV messages
+
+// Receivers expect to hear from us now and then, even when nothing
+// changes.
+#define KEEPALIVE 1000000000ULL
+
+struct sacn_univ {
+  struct universe *univ;
+  int e131univ;
+  int seq;
+  uint64_t lastsent;
+  struct univ_tracer trace;
+  int queued;                         // this tick
+  struct sockaddr_in mcast;
+  unsigned char hdr[E131_HDRLEN];
+  unsigned char shadow[UNIV_NSLOTS];  // what we last sent
+};
+
+static struct sacn_univ *univ;
+static int numuniv;
+
+static struct sockaddr_in hosts[MAXHOSTS];
+static int numhosts;
+
+static int interval = 22727;           // 44 Hz
+static int priority = E131_PRIORITY;
+static int firstuniv = 1;
+static int always = 0;
+static int realtime = 0;   // SCHED_FIFO priority, 0: not real-time
+static int cpu = -1;
+static int copies = 1;
+static int bench = 0;
+static char *source = "dmx_sacn";
+static char *ifaddr = NULL;
+
+static unsigned char cid[E131_CIDLEN];
+
+
+static void pabort(const char *s)
+{
+  perror(s);
+  exit(1);
+}
+
+
+static void print_usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-hIiupnFcBRP] file[:universe] ...\n", prog);
+  fputs("  -h --host     send to this host instead of multicast (may repeat)\n"
+        "  -I --iface    address of the interface to multicast from\n"
+        "  -i --interval frame interval (usec, default 22727: 44 Hz)\n"
+        "  -u --universe E1.31 universe of the first file (default 1),\n"
+        "                the others follow unless given with the file\n"
+        "  -p --priority priority (default 100)\n"
+        "  -n --name     source name\n"
+        "  -F --full     send every universe every frame, not just changes\n"
+        "  -c --copies   send the list of files this many times, on\n"
+        "                consecutive universes (for testing)\n"
+        "  -B --bench    send as fast as possible for this many seconds\n"
+        "                and report packets per second\n"
+        "  -R --realtime SCHED_FIFO at priority 50 (or --realtime=prio),\n"
+        "                memory locked (see rt.h); reports how late it\n"
+        "                woke up every 10 seconds\n"
+        "  -P --cpu      run on this cpu only\n", stderr);
+  exit(EXIT_FAILURE);
+}
+
+static const struct option lopts[] = {
+  { "host",      1, 0, 'h' },
+  { "iface",     1, 0, 'I' },
+  { "interval",  1, 0, 'i' },
+  { "universe",  1, 0, 'u' },
+  { "priority",  1, 0, 'p' },
+  { "name",      1, 0, 'n' },
+  { "full",      0, 0, 'F' },
+  { "copies",    1, 0, 'c' },
+  { "bench",     1, 0, 'B' },
+  { "realtime",  2, 0, 'R' },
+  { "cpu",       1, 0, 'P' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
+
+
+static void add_host (char *host)
+{
+  struct addrinfo hints, *res;
+  int s;
+
+  if (numhosts >= MAXHOSTS) {
+    fprintf (stderr, "too many hosts (max %d)\n", MAXHOSTS);
+    exit (1);
+  }
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  s = getaddrinfo (host, E131_PORT, &hints, &res);
+  if (s != 0) {
+    fprintf (stderr, "%s: %s\n", host, gai_strerror (s));
+    exit (1);
+  }
+  memcpy (&hosts[numhosts++], res->ai_addr, sizeof (hosts[0]));
+  freeaddrinfo (res);
+}
+
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "h:I:i:u:p:n:Fc:B:R::P:", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'h':add_host (optarg);break;
+    case 'I':ifaddr = optarg;break;
+    case 'i':interval = atoi (optarg);break;
+    case 'u':firstuniv = atoi (optarg);break;
+    case 'p':priority = atoi (optarg);break;
+    case 'n':source = optarg;break;
+    case 'F':always = 1;break;
+    case 'c':copies = atoi (optarg);break;
+    case 'B':bench = atoi (optarg);break;
+    case 'R':realtime = optarg ? atoi (optarg) : RT_PRIO;break;
+    case 'P':cpu = atoi (optarg);break;
+    default: print_usage (argv[0]);break;
+    }
+  }
+  return optind;
+}
+
+
+static void add_univ (struct universe *u, int e131univ)
+{
+  struct sacn_univ *su;
+  char mcast[0x20];
+
+  if (numuniv >= MAXUNIV) {
+    fprintf (stderr, "too many universes (max %d)\n", MAXUNIV);
+    exit (1);
+  }
+  if ((e131univ < 1) || (e131univ > 63999)) {
+    fprintf (stderr, "%s: E1.31 universes are 1-63999\n", u->name);
+    exit (1);
+  }
+  su = &univ[numuniv++];
+  su->univ = u;
+  su->e131univ = e131univ;
+  e131_mcast_addr (mcast, e131univ);
+  su->mcast.sin_family = AF_INET;
+  su->mcast.sin_port = htons (atoi (E131_PORT));
+  inet_aton (mcast, &su->mcast.sin_addr);
+  e131_header (su->hdr, cid, source, e131univ, priority, 0, 0, UNIV_NSLOTS - 1);
+}
+
+
+static int open_socket (void)
+{
+  struct in_addr ia;
+  int sfd, ttl = 4;
+  int sndbuf = 4 << 20;
+
+  sfd = socket (AF_INET, SOCK_DGRAM, 0);
+  if (sfd < 0)
+    pabort ("socket");
+  setsockopt (sfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof (ttl));
+  // Room for a whole frame's worth of packets.
+  setsockopt (sfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof (sndbuf));
+  if (ifaddr) {
+    if (!inet_aton (ifaddr, &ia)) {
+      fprintf (stderr, "%s: not an IPv4 address\n", ifaddr);
+      exit (1);
+    }
+    if (setsockopt (sfd, IPPROTO_IP, IP_MULTICAST_IF, &ia, sizeof (ia)) < 0)
+      pabort (ifaddr);
+  }
+  return sfd;
+}
+
+
+static struct mmsghdr msgs[MAXBATCH];
+static struct iovec iov[MAXBATCH][2];
+static int nmsgs;
+static uint64_t npackets;
+
+static void flush_msgs (int sfd)
+{
+  int i, sent;
+
+  for (i=0;i<nmsgs;i+=sent) {
+    sent = sendmmsg (sfd, msgs + i, nmsgs - i, 0);
+    if (sent <= 0) {
+      // Nobody listening is not a reason to stop.
+      perror ("sendmmsg");
+      break;
+    }
+    npackets += sent;
+  }
+  nmsgs = 0;
+}
+
+
+static void queue_msg (int sfd, struct sacn_univ *su, struct sockaddr_in *to)
+{
+  struct msghdr *mh;
+
+  if (nmsgs == MAXBATCH)
+    flush_msgs (sfd);
+  iov[nmsgs][0].iov_base = su->hdr;
+  iov[nmsgs][0].iov_len = E131_HDRLEN;
+  // the data goes out straight from the universe file.
+  iov[nmsgs][1].iov_base = su->univ->data + 1;
+  iov[nmsgs][1].iov_len = UNIV_NSLOTS - 1;
+  mh = &msgs[nmsgs].msg_hdr;
+  mh->msg_name = to;
+  mh->msg_namelen = sizeof (*to);
+  mh->msg_iov = iov[nmsgs];
+  mh->msg_iovlen = 2;
+  nmsgs++;
+}
+
+
+// Queue the packets for one frame tick, send them in one go.
+static void send_tick (int sfd, uint64_t now, int full)
+{
+  struct univ_range r[1];
+  struct sacn_univ *su;
+  int i, h;
+
+  for (i=0;i<numuniv;i++) {
+    su = &univ[i];
+    univ_trace_take (su->univ, &su->trace);
+    if (!full &&
+        !univ_diff (su->shadow, su->univ->data, UNIV_NSLOTS, r, 1) &&
+        (now - su->lastsent < KEEPALIVE))
+      continue;
+    if (!full)
+      memcpy (su->shadow, su->univ->data, UNIV_NSLOTS);
+    su->seq = (su->seq + 1) & 0xff;
+    su->hdr[111] = su->seq;
+    su->hdr[125] = su->univ->data[0];
+    su->lastsent = now;
+    su->queued = 1;
+
+    if (numhosts == 0)
+      queue_msg (sfd, su, &su->mcast);
+    for (h=0;h<numhosts;h++)
+      queue_msg (sfd, su, &hosts[h]);
+  }
+  flush_msgs (sfd);
+
+  now = univ_time_ns ();
+  for (i=0;i<numuniv;i++) {
+    su = &univ[i];
+    if (!su->queued) continue;
+    univ_trace_ship (su->univ, &su->trace, UNIV_STAGE_SACN, now);
+    su->queued = 0;
+  }
+}
+
+
+static void run_bench (int sfd)
+{
+  struct rusage ru;
+  uint64_t start, end, now;
+  double secs, cpu;
+
+  start = univ_time_ns ();
+  end = start + bench * 1000000000ULL;
+  do {
+    send_tick (sfd, 0, 1);
+    now = univ_time_ns ();
+  } while (now < end);
+
+  getrusage (RUSAGE_SELF, &ru);
+  secs = (now - start) / 1e9;
+  cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  printf ("%d universes: %llu packets in %.2f s, %.0f packets/s, "
+          "%.0f frames/s per universe, %.0f%% cpu\n",
+          numuniv, (unsigned long long) npackets, secs, npackets / secs,
+          npackets / secs / numuniv / (numhosts ? numhosts : 1),
+          100 * cpu / secs);
+}
+
+
+int main(int argc, char **argv)
+{
+  struct universe *u;
+  uint64_t now, next, nextreport;
+  int nonoptions, sfd, i, c, nfiles, e131univ;
+  char *fname, *p;
+
+  nonoptions = parse_opts(argc, argv);
+  nfiles = argc - nonoptions;
+  if ((nfiles < 1) || (copies < 1))
+    print_usage (argv[0]);
+
+  univ = calloc (MAXUNIV, sizeof (*univ));
+  if (!univ)
+    pabort ("calloc");
+  e131_make_cid (cid);
+
+  for (c=0;c<copies;c++)
+    for (i=0;i<nfiles;i++) {
+      fname = strdup (argv[nonoptions + i]);
+      e131univ = firstuniv + i;
+      p = strchr (fname, ':');
+      if (p) {
+        *p++ = 0;
+        e131univ = atoi (p);
+      }
+      u = (c == 0) ? univ_open (fname) : univ[i].univ;
+      add_univ (u, e131univ + c * nfiles);
+      free (fname);
+    }
+
+  sfd = open_socket ();
+  if (realtime)
+    rt_setup (realtime, cpu);
+  else if (cpu >= 0)
+    rt_pin (cpu);
+
+  if (bench) {
+    run_bench (sfd);
+    exit (0);
+  }
+
+  next = univ_time_ns ();
+  nextreport = next + RT_REPORTINT;
+  while (1) {
+    univ_sleep_until (next);
+    next += interval * 1000ULL;
+    now = univ_time_ns ();
+    send_tick (sfd, now, always);
+    if (realtime && (now > nextreport)) {
+      rt_report ("dmx_sacn: ", "\n");
+      nextreport += RT_REPORTINT;
+    }
+  }
+
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,563 @@
+/*
+ * dmx_server.c
+ *
+ * Universe server: owns one shared memory arena with room for
+ * thousands of universes, and takes commands on a unix socket.
+ *
+ * The arena (UNIV_ARENA, or $DMX_ARENA) holds UNIV_FILESIZE for every
+ * universe, each laid out like a universe file. All tools open
+ * universe N of it as "@N": the arena is mapped once per process, so a
+ * network bridge for hundreds of universes needs neither hundreds of
+ * files nor hundreds of file descriptors. What's in the arena survives
+ * a restart of the server.
+ *
+ * The socket (the arena's name with ".sock" added, or -s) takes one
+ * command per line, and answers each with "ok", or "error: why":
+ *
+ *   set U chan[-chan] V ...  set channels: one value for all, or one each
+ *   get U chan[-chan]        the values, on one line before the "ok"
+ *   fade U chan[-chan] V T   fade channels to V in T seconds
+ *   load U scene [T]         set (or fade in T s) all channels from a scene
+ *   snapshot U scene         save the slots of U as a scene
+ *   who                      for every universe written since we
+ *                            started: its generation and its last writer
+ *
+ * Channels are numbered as set_dmx does. A scene file is anything that
+ * holds the slots at its start, like a universe file: snapshots can be
+ * loaded again, or handed to dmx_fade. Scenes are files in the scene
+ * directory (-d); names with a "/" in them or that start with a "."
+ * are refused, so clients can't get at other files.
+ *
+ * The socket gets the permissions the umask leaves, so by default only
+ * our own user can connect; -m sets its mode, e.g. 0660 for a group.
+ *
+ * Every commit stamps the pid of the writer in the universe header;
+ * for changes made through the socket that is the client's pid.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#define _GNU_SOURCE   // for struct ucred and accept4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "universe.h"
+
+#define NCHAN      (UNIV_NSLOTS - 1)
+#define MAXCLIENT  64
+#define MAXFADE    16384
+
+struct client {
+  int fd;
+  pid_t pid;
+  int len;
+  int skip;                         // in a line that was too long
+  int dead;                         // didn't take its answers: drop it
+  char buf[4 * UNIV_NSLOTS + 32];   // a "set" with all 512 values
+};
+
+// One channel on its way somewhere, in 16.16 fixed point.
+struct fade {
+  int univ, slot;
+  pid_t pid;                        // the client that started it
+  uint32_t cur, target;
+  int32_t step;
+  int left;
+};
+
+static int nuniv = 1024;
+static struct universe **univ;      // nuniv of them, all in the arena
+static uint32_t *startgen;          // the generations when we started
+
+static struct client clients[MAXCLIENT];
+static int nclients;
+
+static struct fade fades[MAXFADE];
+static int nfades;
+
+static char *sockname = NULL;
+static int sockmode = -1;           // -1: as the umask leaves it
+static char *scenedir = ".";
+static int interval = 22727;        // 44 Hz
+
+
+static void pabort(const char *s)
+{
+  perror(s);
+  exit(1);
+}
+
+
+static void print_usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-nsmdi]\n", prog);
+  fputs("  -n --universes number of universes in the arena (default 1024)\n"
+        "  -s --socket    command socket (default: the arena's name + .sock)\n"
+        "  -m --mode      permissions of the socket (octal, e.g. 0660)\n"
+        "  -d --scenes    directory for load and snapshot (default .)\n"
+        "  -i --interval  fade frame interval (usec, default 22727: 44 Hz)\n", stderr);
+  exit(EXIT_FAILURE);
+}
+
+static const struct option lopts[] = {
+  { "universes", 1, 0, 'n' },
+  { "socket",    1, 0, 's' },
+  { "mode",      1, 0, 'm' },
+  { "scenes",    1, 0, 'd' },
+  { "interval",  1, 0, 'i' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
+
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "n:s:m:d:i:", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'n':nuniv = atoi (optarg);break;
+    case 's':sockname = optarg;break;
+    case 'm':sockmode = strtol (optarg, NULL, 8);break;
+    case 'd':scenedir = optarg;break;
+    case 'i':interval = atoi (optarg);break;
+    default: print_usage (argv[0]);break;
+    }
+  }
+  return optind;
+}
+
+
+/*
+ * Create the arena, or take over the one that's there: a restart of
+ * the server should not black out the rig. It only ever grows.
+ */
+static void open_arena (void)
+{
+  struct stat statb;
+  char *name, uname[0x10];
+  int fd, i;
+
+  name = univ_arena_name ();
+  fd = open (name, O_RDWR | O_CREAT, 0666);
+  if ((fd < 0) || (fstat (fd, &statb) < 0))
+    pabort (name);
+  if (statb.st_size > (off_t) nuniv * UNIV_FILESIZE)
+    nuniv = statb.st_size / UNIV_FILESIZE;
+  else if (ftruncate (fd, (off_t) nuniv * UNIV_FILESIZE) < 0)
+    pabort (name);
+  // Others that map it may not share our umask.
+  fchmod (fd, 0666);
+  close (fd);
+
+  univ = calloc (nuniv, sizeof (*univ));
+  startgen = calloc (nuniv, sizeof (*startgen));
+  if (!univ || !startgen)
+    pabort ("calloc");
+  for (i=0;i<nuniv;i++) {
+    sprintf (uname, "@%d", i);
+    univ[i] = univ_open (uname);
+    startgen[i] = univ[i]->hdr->gen;
+  }
+}
+
+
+static int open_socket (void)
+{
+  struct sockaddr_un sa;
+  int sfd;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sun_family = AF_UNIX;
+  if (strlen (sockname) >= sizeof (sa.sun_path)) {
+    fprintf (stderr, "%s: name too long\n", sockname);
+    exit (1);
+  }
+  strcpy (sa.sun_path, sockname);
+  unlink (sockname);
+
+  sfd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (sfd < 0)
+    pabort ("socket");
+  if (bind (sfd, (struct sockaddr *) &sa, sizeof (sa)) < 0)
+    pabort (sockname);
+  if ((sockmode >= 0) && (chmod (sockname, sockmode) < 0))
+    pabort (sockname);
+  if (listen (sfd, 8) < 0)
+    pabort ("listen");
+  return sfd;
+}
+
+
+/*
+ * The client sockets don't block: a client that doesn't read its
+ * answers until they no longer fit is dropped, rather than holding up
+ * the others and the fades.
+ */
+static void reply (struct client *cl, char *s)
+{
+  int n = strlen (s);
+
+  if (!cl->dead && (write (cl->fd, s, n) != n))
+    cl->dead = 1;
+}
+
+
+static int parse_range (char *s, int *a, int *b)
+{
+  *a = *b = strtol (s, &s, 0);
+  if (*s == '-') *b = strtol (s+1, &s, 0);
+  return !*s && (*a >= 0) && (*b < NCHAN) && (*a <= *b);
+}
+
+
+static void set_slots (struct client *cl, struct universe *u, int start,
+                       unsigned char *buf, int len)
+{
+  if (univ_write (u, start, buf, len))
+    u->hdr->writer = cl->pid;
+}
+
+
+static int frames (double secs)
+{
+  int n;
+
+  n = secs * 1e6 / interval + 0.5;
+  return n < 1 ? 1 : n;
+}
+
+
+// Forget the fades of channels a .. b of universe n.
+static void drop_fades (int n, int a, int b)
+{
+  int i, j;
+
+  for (i=j=0;i<nfades;i++) {
+    if ((fades[i].univ == n) && (fades[i].slot > a) && (fades[i].slot <= b+1))
+      continue;
+    fades[j++] = fades[i];
+  }
+  nfades = j;
+}
+
+
+// Fade channels a .. b of universe n to the levels in v[] in secs.
+static char *start_fades (struct client *cl, int n, int a, int b,
+                          unsigned char *v, double secs)
+{
+  struct fade *f;
+  int c, nf;
+
+  drop_fades (n, a, b);
+  if (nfades + (b - a + 1) > MAXFADE)
+    return "error: too many fades\n";
+  nf = frames (secs);
+  for (c=a;c<=b;c++) {
+    f = &fades[nfades++];
+    f->univ = n;
+    f->slot = c + 1;
+    f->pid = cl->pid;
+    f->cur = (uint32_t) (univ[n]->data[c+1] * 257) << 16;
+    f->target = (uint32_t) (v[c-a] * 257) << 16;
+    f->step = ((int64_t) f->target - f->cur) / nf;
+    f->left = nf;
+  }
+  return "ok\n";
+}
+
+
+static void commit_fades (int n, pid_t pid)
+{
+  univ_commit (univ[n]);
+  univ[n]->hdr->writer = pid;
+}
+
+
+/*
+ * One frame of all fades. The fades of one command sit together in
+ * the list, so a universe is committed once per run of its fades. A
+ * fade that arrives lands exactly on its target, and is removed.
+ */
+static void step_fades (void)
+{
+  struct fade *f;
+  struct universe *u;
+  pid_t pid = 0;
+  int i, j, last = -1, changed = 0;
+
+  for (i=j=0;i<nfades;i++) {
+    f = &fades[i];
+    if (f->univ != last) {
+      if (changed) commit_fades (last, pid);
+      last = f->univ;
+      changed = 0;
+    }
+    pid = f->pid;
+    u = univ[f->univ];
+    if (--f->left <= 0) f->cur = f->target;
+    else                f->cur += f->step;
+    if (u->data[f->slot] != (f->cur >> 24)) {
+      u->data[f->slot] = f->cur >> 24;
+      univ_mark (u, f->slot, 1);
+      changed = 1;
+    }
+    if (f->left > 0) fades[j++] = *f;
+  }
+  if (changed) commit_fades (last, pid);
+  nfades = j;
+}
+
+
+/*
+ * The path of a scene in the scene directory, or NULL for a name that
+ * could reach outside it.
+ */
+static char *scene_path (char *name)
+{
+  static char path[0x200];
+
+  if (!name[0] || (name[0] == '.') || strchr (name, '/'))
+    return NULL;
+  if (snprintf (path, sizeof (path), "%s/%s", scenedir, name) >= sizeof (path))
+    return NULL;
+  return path;
+}
+
+
+static int load_scene (char *name, unsigned char *slots)
+{
+  char *path;
+  int fd, n;
+
+  if (!(path = scene_path (name))) return -1;
+  fd = open (path, O_RDONLY);
+  if (fd < 0) return -1;
+  n = read (fd, slots, UNIV_NSLOTS);
+  close (fd);
+  return (n == UNIV_NSLOTS) ? 0 : -1;
+}
+
+
+static char *cmd_who (struct client *cl)
+{
+  struct univ_hdr *h;
+  char line[0x100], comm[0x40];
+  FILE *f;
+  int i;
+
+  for (i=0;i<nuniv;i++) {
+    h = univ[i]->hdr;
+    if (h->gen == startgen[i]) continue;
+    strcpy (comm, "?");
+    sprintf (line, "/proc/%u/comm", h->writer);
+    if ((f = fopen (line, "r"))) {
+      if (fgets (comm, sizeof (comm), f))
+        comm[strcspn (comm, "\n")] = 0;
+      fclose (f);
+    }
+    sprintf (line, "%d gen %u writer %u %s\n", i, h->gen, h->writer, comm);
+    reply (cl, line);
+    if (cl->dead)
+      break;
+  }
+  return "ok\n";
+}
+
+
+static char *do_command (struct client *cl, char *line)
+{
+  static unsigned char v[UNIV_NSLOTS];
+  static char out[NCHAN * 4 + 2];
+  struct universe *u;
+  char *argv[NCHAN + 4];
+  char *path;
+  int argc, n, a, b, c, fd;
+
+  for (argc=0;argc<NCHAN+4;argc++)
+    if (!(argv[argc] = strtok (argc ? NULL : line, " \t\r\n")))
+      break;
+  if ((argc == 0) || (argv[0][0] == '#'))
+    return NULL;
+  if (strcmp (argv[0], "who") == 0)
+    return cmd_who (cl);
+  if ((argc < 2) || ((n = atoi (argv[1])) < 0) || (n >= nuniv))
+    return "error: no such universe\n";
+  u = univ[n];
+
+  if ((strcmp (argv[0], "set") == 0) && (argc >= 4) &&
+      parse_range (argv[2], &a, &b)) {
+    if ((argc != 4) && (argc - 3 != b - a + 1))
+      return "error: one value, or one per channel\n";
+    for (c=a;c<=b;c++)
+      v[c-a] = strtol (argv[(argc == 4) ? 3 : 3 + c - a], NULL, 0);
+    drop_fades (n, a, b);
+    set_slots (cl, u, a + 1, v, b - a + 1);
+  } else if ((strcmp (argv[0], "get") == 0) && (argc == 3) &&
+             parse_range (argv[2], &a, &b)) {
+    for (c=a,out[0]=0;c<=b;c++)
+      sprintf (out + strlen (out), "%s%d", (c == a) ? "" : " ", u->data[c+1]);
+    strcat (out, "\n");
+    reply (cl, out);
+  } else if ((strcmp (argv[0], "fade") == 0) && (argc == 5) &&
+             parse_range (argv[2], &a, &b)) {
+    memset (v, strtol (argv[3], NULL, 0), b - a + 1);
+    return start_fades (cl, n, a, b, v, atof (argv[4]));
+  } else if ((strcmp (argv[0], "load") == 0) && ((argc == 3) || (argc == 4))) {
+    if (load_scene (argv[2], v) < 0)
+      return "error: can't read the scene\n";
+    if (argc == 4)
+      return start_fades (cl, n, 0, NCHAN - 1, v + 1, atof (argv[3]));
+    drop_fades (n, 0, NCHAN - 1);
+    set_slots (cl, u, 1, v + 1, NCHAN);
+  } else if ((strcmp (argv[0], "snapshot") == 0) && (argc == 3)) {
+    if (!(path = scene_path (argv[2])))
+      return "error: bad scene name\n";
+    fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+      return "error: can't create the file\n";
+    n = write (fd, u->data, UNIV_NSLOTS);
+    close (fd);
+    if (n != UNIV_NSLOTS)
+      return "error: writing the file\n";
+  } else {
+    return "error: bad command\n";
+  }
+  return "ok\n";
+}
+
+
+// Run the complete lines that came in. Returns -1 when the client left,
+// or has to go.
+static int read_commands (struct client *cl)
+{
+  char *p, *nl, *r;
+  int n;
+
+  n = read (cl->fd, cl->buf + cl->len, sizeof (cl->buf) - 1 - cl->len);
+  if (n <= 0)
+    return ((n < 0) && (errno == EAGAIN)) ? 0 : -1;
+  cl->len += n;
+  cl->buf[cl->len] = 0;
+  for (p=cl->buf;!cl->dead && (nl = strchr (p, '\n'));p=nl+1) {
+    *nl = 0;
+    if (cl->skip) {
+      // The end of a line that didn't fit.
+      cl->skip = 0;
+      continue;
+    }
+    if ((r = do_command (cl, p)))
+      reply (cl, r);
+  }
+  cl->len -= p - cl->buf;
+  memmove (cl->buf, p, cl->len);
+  // A line that doesn't fit is refused, and skipped up to its end.
+  if (cl->len == sizeof (cl->buf) - 1) {
+    if (!cl->skip)
+      reply (cl, "error: line too long\n");
+    cl->skip = 1;
+    cl->len = 0;
+  }
+  return cl->dead ? -1 : 0;
+}
+
+
+static void new_client (int sfd)
+{
+  struct client *cl;
+  struct ucred cred;
+  socklen_t len = sizeof (cred);
+  int fd;
+
+  fd = accept4 (sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) return;
+  if (nclients >= MAXCLIENT) {
+    close (fd);
+    return;
+  }
+  cl = &clients[nclients++];
+  memset (cl, 0, sizeof (*cl));
+  cl->fd = fd;
+  if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+    cl->pid = cred.pid;
+}
+
+
+int main(int argc, char **argv)
+{
+  struct pollfd pfd[MAXCLIENT + 1];
+  uint64_t next, now;
+  int sfd, i, timeout;
+
+  parse_opts(argc, argv);
+  if (nuniv < 1) print_usage (argv[0]);
+  if (!sockname) {
+    sockname = malloc (strlen (univ_arena_name ()) + 6);
+    sprintf (sockname, "%s.sock", univ_arena_name ());
+  }
+  // A client that goes away mid-answer is no reason to stop.
+  signal (SIGPIPE, SIG_IGN);
+
+  open_arena ();
+  sfd = open_socket ();
+  fprintf (stderr, "%d universes in %s, commands on %s\n",
+           nuniv, univ_arena_name (), sockname);
+
+  next = univ_time_ns ();
+  while (1) {
+    pfd[0].fd = sfd;
+    pfd[0].events = POLLIN;
+    for (i=0;i<nclients;i++) {
+      pfd[i+1].fd = clients[i].fd;
+      pfd[i+1].events = POLLIN;
+    }
+    // Only wake up for frames while something is fading.
+    timeout = -1;
+    if (nfades) {
+      now = univ_time_ns ();
+      timeout = (next > now) ? (next - now + 999999) / 1000000 : 0;
+    }
+    if (poll (pfd, nclients + 1, timeout) < 0)
+      if (errno != EINTR) pabort ("poll");
+
+    for (i=nclients-1;i>=0;i--) {
+      if (!(pfd[i+1].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+      if (read_commands (&clients[i]) < 0) {
+        close (clients[i].fd);
+        clients[i] = clients[--nclients];
+      }
+    }
+    if (pfd[0].revents & POLLIN)
+      new_client (sfd);
+
+    now = univ_time_ns ();
+    if (!nfades) {
+      next = now;
+    } else if (now >= next) {
+      step_fades ();
+      next += interval * 1000ULL;
+      if (next < now) next = now + interval * 1000ULL;
+    }
+  }
+  exit(EXIT_SUCCESS);
+}
@@ -1,96 +1,732 @@
+/*
+ * dmx_uart.c
+ *
+ * Send universes out of plain UARTs (with an RS485 driver behind
+ * them), such as the one on the pi's GPIO header or USB-RS485
+ * dongles: one universe per UART.
+ *
+ * All UARTs are driven from one thread. Frames start on a common
+ * clock, each port a little after the one before it so that their
+ * breaks don't all need attention at the same moment. A frame is a
+ * break, the mark-after-break and the slots in one non-blocking
+ * write; at the next tick TIOCOUTQ tells whether they have all left,
+ * as the next break must not cut off the frame. A timerfd for the
+ * next of these steps, and the ports whose writes didn't fit at once,
+ * are watched with epoll. Steps that are very close are waited for
+ * by spinning. Break and MAB only ever come out longer than asked,
+ * when a wakeup is late, and that is allowed.
+ *
+ * With -T each universe goes to a pty instead, and the other end is
+ * read back to check the frame rate and how well the ports keep in
+ * step.
+ *
+ * With -r it receives instead, from one UART. The UART marks breaks in
+ * the data with PARMRK, so frames can be cut out of the byte stream;
+ * each complete frame goes into the universe file with univ_write.
+ * Reads ask for many bytes at once (VMIN), so a frame takes a handful
+ * of system calls.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#define _GNU_SOURCE   // for ptsname and friends
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <getopt.h>
 #include <fcntl.h>
-#include <sys/mman.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+// Not <termios.h>: termios2 and BOTHER, for the 250 kbaud that isn't
+// one of the standard rates, only come with the kernel's definitions.
+#include <asm/termbits.h>
 
+#include "dmx.h"
+#include "universe.h"
+#include "patch.h"
+#include "rt.h"
 
-#include <stropts.h>
-#include <asm/termios.h>
+#define DMX_BAUD  250000
 
-//#include <sys/ioctl.h>
+#define MAXPORT   16
 
-extern int tcgetattr (int __fd, struct termios *__termios_p) __THROW;
-extern void cfmakeraw (struct termios *__termios_p) __THROW;
-extern int tcsetattr (int __fd, int __optional_actions,
-                      const struct termios *__termios_p) __THROW;
+// Wakeups are only accurate to tens of microseconds: steps closer
+// than this are waited for by spinning.
+#define SPINTIME  50000ULL   // nsec
 
+// Mark between frames: room for the system calls around the break.
+#define MTBP      100        // usec
 
+// Consecutive ports start their frames this much apart.
+#define STAGGER   250        // usec
 
-int main (int argc, char **argv)
+#define NEVER     ~0ULL
+
+enum { TX_WAIT, TX_BREAK, TX_MAB, TX_WRITE };
+
+struct uart {
+  char *device;
+  char *arg;           // file[=patch][:channels[:break[:mab]]]
+  int fd;
+  struct universe *univ;
+  struct patch *patch;
+  struct config cfg;
+
+  // Send: where in the frame we are, and when the next step is due.
+  int phase;
+  uint64_t due;
+  uint64_t tick;       // frame number on the common clock
+  uint64_t tickstart;  // when the next frame should start
+  uint64_t frametick;  // when the one on the line should have
+  uint64_t start;      // when its break did start
+  uint64_t datastart;  // when the slots went to the UART
+  int len, written;
+  struct univ_tracer trace;
+
+  // Receive: the frame being assembled.
+  int state;
+  int esc;             // where we are in a PARMRK escape
+  int n;
+  int last;            // set when the previous frame came in whole
+  unsigned char rxbuf[UNIV_NSLOTS];
+
+  // -T: the other end of the pty, and what arrives there.
+  int master;
+  uint64_t vlastbyte, vlaststart;
+  int vframes, vbytes;
+  uint64_t vlag, vlag_max, vjitter_max;
+
+  // Statistics since the last report.
+  int frames;
+  uint64_t late, late_max;
+  uint64_t busy;       // break to last slot, summed
+};
+
+static struct uart ports[MAXPORT];
+static int numports;
+
+// The common frame clock: port i starts frame k at
+// epoch + k * period + i * STAGGER.
+static uint64_t epoch, period;
+
+static char *device = "/dev/ttyAMA0";
+static int nchan = 512;
+static int breaktime = DMX_BREAK;
+static int mab = DMX_MAB;
+static int interval = 0;   // usec, 0: as fast as the longest frame allows
+static int verbose = 0;
+static int rxmode = 0;
+static int ptytest = 0;
+static int realtime = 0;   // SCHED_FIFO priority, 0: not real-time
+static int cpu = -1;
+
+static int epfd;
+
+
+static void pabort(const char *s)
 {
-  char *thefile;
-  char *data;
-  int infd, uartfd;
-  char *theuart = "/dev/ttyAMA0";
-  struct termios my_tios;
-  struct termios2 tio;
+  perror(s);
+  exit(1);
+}
+
+
+static void print_usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-cbmiVrTRP] [-D dev] file[=patch][:channels[:break[:mab]]]\n"
+          "       %s [options] -D dev file -D dev file ...\n", prog, prog);
+  fputs("  -D --device   uart for the file(s) after it (default /dev/ttyAMA0)\n"
+        "  -r --rx       receive DMX into the file (one uart only)\n"
+        "  -c --channels number of channels to send (default 512)\n"
+        "  -b --break    break time (usec, default 176)\n"
+        "  -m --mab      mark-after-break time (usec, default 12)\n"
+        "  -i --interval time between frames (usec, default: the longest\n"
+        "                frame time, 22.9 ms for 512 channels)\n"
+        "  -T --ptytest  send to ptys and report the timing seen there\n"
+        "  -V --verbose  print statistics every second\n"
+        "  -R --realtime SCHED_FIFO at priority 50 (or --realtime=prio),\n"
+        "                memory locked (see rt.h)\n"
+        "  -P --cpu      run on this cpu only\n", stderr);
+  exit(EXIT_FAILURE);
+}
+
+static const struct option lopts[] = {
+  { "device",    1, 0, 'D' },
+  { "channels",  1, 0, 'c' },
+  { "break",     1, 0, 'b' },
+  { "mab",       1, 0, 'm' },
+  { "interval",  1, 0, 'i' },
+  { "verbose",   0, 0, 'V' },
+  { "rx",        0, 0, 'r' },
+  { "ptytest",   0, 0, 'T' },
+  { "realtime",  2, 0, 'R' },
+  { "cpu",       1, 0, 'P' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
 
 
-  thefile = argv[1];
-  infd = open (thefile, O_RDWR); 
-  if (infd < 0) {
-     perror (thefile);
-     exit (1);
+static void add_port (char *arg)
+{
+  struct uart *ua;
+
+  if (numports >= MAXPORT) {
+    fprintf (stderr, "too many uarts (max %d)\n", MAXPORT);
+    exit (1);
   }
-  data = mmap (NULL, 0x200, PROT_READ | PROT_WRITE, MAP_SHARED, infd, 0);
- 
-  uartfd = open (theuart, O_RDWR);
-  if (uartfd < 0) {
-     perror (theuart);
-     exit (1);
+  ua = &ports[numports++];
+  ua->device = device;
+  ua->arg = arg;
+}
+
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    // The leading '-' hands us the files in order, so that each gets
+    // the -D before it.
+    c = getopt_long(argc, argv, "-D:c:b:m:i:VrTR::P:", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 1:  add_port (optarg);break;
+    case 'D':device = optarg;break;
+    case 'c':nchan = atoi (optarg);break;
+    case 'b':breaktime = atoi (optarg);break;
+    case 'm':mab = atoi (optarg);break;
+    case 'i':interval = atoi (optarg);break;
+    case 'V':verbose = 1;break;
+    case 'R':realtime = optarg ? atoi (optarg) : RT_PRIO;break;
+    case 'P':cpu = atoi (optarg);break;
+    case 'r':rxmode = 1;break;
+    case 'T':ptytest = 1;break;
+    default: print_usage (argv[0]);break;
+    }
   }
+  return optind;
+}
+
+
+// -T: give the port a fresh pty, and keep the other end to listen on.
+static void open_pty (struct uart *ua)
+{
+  ua->master = posix_openpt (O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if ((ua->master < 0) || (grantpt (ua->master) < 0) ||
+      (unlockpt (ua->master) < 0))
+    pabort ("pty");
+  ua->device = strdup (ptsname (ua->master));
+}
+
 
-  if (tcgetattr(uartfd, &my_tios) < 0) {  // get current settings
-      perror ("tcgetattr");
-      exit (1);
-  } 
+/*
+ * Raw, 8 data bits, 2 stop bits, no parity at 250 kbaud. For receive,
+ * PARMRK makes a break show up as 0xff 0x00 0x00 (and a framing error
+ * as 0xff 0x00 c, a real 0xff as 0xff 0xff). BRKINT stays off: it
+ * would flush the input instead of marking the break. A read returns
+ * when VMIN bytes are in, or the line has been quiet for VTIME.
+ * Sending doesn't block: a write that doesn't fit is finished when
+ * epoll says there is room.
+ */
+static void setup_uart (struct uart *ua)
+{
+  struct termios2 tio;
+
+  ua->fd = open (ua->device, O_RDWR | O_NOCTTY | (rxmode ? 0 : O_NONBLOCK));
+  if (ua->fd < 0)
+    pabort (ua->device);
+  if (ioctl (ua->fd, TCGETS2, &tio) < 0)
+    pabort ("TCGETS2");
+
+  tio.c_iflag = rxmode ? PARMRK : 0;
+  tio.c_oflag = 0;
+  tio.c_lflag = 0;
+  tio.c_cflag = CS8 | CSTOPB | CLOCAL | CREAD | BOTHER;
+  tio.c_ispeed = DMX_BAUD;
+  tio.c_ospeed = DMX_BAUD;
+  tio.c_cc[VMIN] = rxmode ? 255 : 1;
+  tio.c_cc[VTIME] = rxmode ? 1 : 0;
+  if (ioctl (ua->fd, TCSETS2, &tio) < 0)
+    pabort ("TCSETS2");
+}
 
-  cfmakeraw(&my_tios);  // make it a binary data port
-  my_tios.c_cflag |= CLOCAL;    // port is local, no flow control
-  my_tios.c_cflag &= ~CSIZE;
-  my_tios.c_cflag |= CS8;       // 8 bit chars
-  my_tios.c_cflag &= ~PARENB;   // no parity
-  my_tios.c_cflag |= CSTOPB;    // 2 stop bit for DMX
-  my_tios.c_cflag &= ~CRTSCTS;  // no CTS/RTS flow control
 
-  if (tcsetattr(uartfd, TCSANOW, &my_tios) < 0) {  // apply settings
-    perror ("tcsetattr");
+static void open_uart_univ (struct uart *ua)
+{
+  struct config *cfg = &ua->cfg;
+  char *fname, *p;
+
+  fname = strdup (ua->arg);
+  cfg->datalen = nchan;
+  cfg->breaktime = breaktime;
+  cfg->mab = mab;
+
+  p = strchr (fname, ':');
+  if (p) {
+    *p++ = 0;
+    cfg->datalen = strtol (p, &p, 0);
+    if (*p == ':') cfg->breaktime = strtol (p+1, &p, 0);
+    if (*p == ':') cfg->mab = strtol (p+1, &p, 0);
+  }
+  if ((cfg->datalen < 1) || (cfg->datalen > 512)) {
+    fprintf (stderr, "%s: channels should be 1-512\n", ua->arg);
     exit (1);
   }
+  ua->patch = patch_arg (fname);
+  ua->univ = univ_open (fname);
+}
 
-  static int rate = 250000;
 
-  if (ioctl(uartfd, TCGETS2, &tio) < 0) {
-    perror ("tcgets2");
-    exit (1);
+static void wait_until (uint64_t t)
+{
+  while (univ_time_ns () < t)
+    ;
+}
+
+
+// Watch for room to write only while a write is unfinished.
+static void want_write (struct uart *ua, int on)
+{
+  struct epoll_event ev;
+
+  ev.events = on ? EPOLLOUT : 0;
+  ev.data.u32 = ua - ports;
+  if (epoll_ctl (epfd, EPOLL_CTL_MOD, ua->fd, &ev) < 0)
+    pabort ("epoll_ctl");
+}
+
+
+/*
+ * Schedule the port's next frame on the common clock. A frame that
+ * ran a little into the next tick is followed right away, late; ticks
+ * that have gone by for longer than half a period are lost.
+ */
+static void next_frame (struct uart *ua, uint64_t now)
+{
+  uint64_t base, k;
+
+  base = epoch + (ua - ports) * STAGGER * 1000ULL;
+  k = ua->tick + 1;
+  if (now > base + k * period + period / 2) {
+    k = (now - base) / period + 1;
+    ua->univ->hdr->tx_drops += k - ua->tick - 1;
   }
+  ua->tick = k;
+  ua->tickstart = ua->due = base + k * period;
+  ua->phase = TX_WAIT;
+}
 
-  tio.c_cflag &= ~CBAUD;
-  tio.c_cflag |= BOTHER;
-  tio.c_ispeed = rate;
-  tio.c_ospeed = rate;  // set custom speed directly
-  if (ioctl(uartfd, TCSETS2, &tio) < 0) {
-    perror ("tcsets2");
-    exit (1);
+
+static void tx_write (struct uart *ua, uint64_t now)
+{
+  uint64_t done;
+  int n;
+
+  // The start code and the channels, straight from the universe.
+  n = write (ua->fd, ua->univ->data + ua->written, ua->len - ua->written);
+  if ((n < 0) && (errno != EAGAIN))
+    pabort (ua->device);
+  if (n > 0) ua->written += n;
+
+  if (ua->written < ua->len) {
+    if (ua->phase != TX_WRITE) want_write (ua, 1);
+    ua->phase = TX_WRITE;
+    ua->due = NEVER;
+    return;
   }
+  if (ua->phase == TX_WRITE) want_write (ua, 0);
+  ua->univ->hdr->tx_frames++;
+  // The write only queued the slots: the last one is out at line rate.
+  done = ua->datastart + ua->len * DMX_SLOTTIME * 1000ULL;
+  univ_trace_ship (ua->univ, &ua->trace, UNIV_STAGE_UART, (done > now) ? done : now);
+  ua->frames++;
+  ua->busy += ua->datastart - ua->start + ua->len * DMX_SLOTTIME * 1000ULL;
+  next_frame (ua, now);
+}
+
+
+/*
+ * Take the next step of the frame on ua. Before the break, the frame
+ * before must have gone out: the period leaves time for that, so if
+ * something is still queued for the UART it is slower than it should
+ * be. Count an overrun and give it the time it needs.
+ */
+static void tx_step (struct uart *ua, uint64_t now)
+{
+  struct config *cfg = &ua->cfg;
+  unsigned char frame[UNIV_NSLOTS];
+  uint64_t late;
+  int queued;
+
+  switch (ua->phase) {
+  case TX_WAIT:
+    if ((ioctl (ua->fd, TIOCOUTQ, &queued) == 0) && (queued > 0)) {
+      ua->univ->hdr->tx_overruns++;
+      ua->due = now + queued * DMX_SLOTTIME * 1000ULL;
+      break;
+    }
+    if (ua->patch) {
+      patch_apply (ua->patch, frame);
+      univ_write (ua->univ, 0, frame, UNIV_NSLOTS);
+    }
+    ua->start = now;
+    ua->frametick = ua->tickstart;
+    late = now - ua->tickstart;
+    ua->late += late;
+    if (late > ua->late_max) ua->late_max = late;
+    if (ioctl (ua->fd, TIOCSBRK, NULL) < 0)
+      pabort ("TIOCSBRK");
+    ua->phase = TX_BREAK;
+    ua->due = now + cfg->breaktime * 1000ULL;
+    break;
+  case TX_BREAK:
+    if (ioctl (ua->fd, TIOCCBRK, NULL) < 0)
+      pabort ("TIOCCBRK");
+    ua->phase = TX_MAB;
+    ua->due = now + cfg->mab * 1000ULL;
+    break;
+  case TX_MAB:
+    ua->len = 1 + cfg->datalen;
+    ua->written = 0;
+    ua->datastart = now;
+    univ_trace_take (ua->univ, &ua->trace);
+    tx_write (ua, now);
+    break;
+  }
+}
+
 
+/*
+ * -T: bytes from the pty. A gap of more than a millisecond starts a
+ * new frame; its lag is how long after its tick on the common clock
+ * it arrived.
+ */
+static void pty_read (struct uart *ua, uint64_t now)
+{
+  unsigned char buf[0x400];
+  uint64_t lag, dt, dev;
+  int n;
+
+  while ((n = read (ua->master, buf, sizeof (buf))) > 0) {
+    if (now - ua->vlastbyte > 1000000) {
+      ua->vframes++;
+      lag = now - ua->frametick;
+      ua->vlag += lag;
+      if (lag > ua->vlag_max) ua->vlag_max = lag;
+      dt = now - ua->vlaststart;
+      dev = (dt > period) ? dt - period : period - dt;
+      if (ua->vlaststart && (dev > ua->vjitter_max)) ua->vjitter_max = dev;
+      ua->vlaststart = now;
+    }
+    ua->vbytes += n;
+    ua->vlastbyte = now;
+  }
+}
+
+
+static void print_pty_stats (struct uart *ua, char *eol)
+{
+  if (!ua->vframes) return;
+  fprintf (stderr, "%s: %d frames/s seen, %d bytes/frame, lag %llu/%llu us, "
+           "jitter %llu us max.%s",
+           ua->device, ua->vframes, ua->vbytes / ua->vframes,
+           (unsigned long long) ua->vlag / ua->vframes / 1000,
+           (unsigned long long) ua->vlag_max / 1000,
+           (unsigned long long) ua->vjitter_max / 1000, eol);
+  ua->vframes = ua->vbytes = 0;
+  ua->vlag = ua->vlag_max = ua->vjitter_max = 0;
+}
+
+
+/*
+ * A frame is complete: account for it and store it. Frames with
+ * another start code than zero are counted, but don't carry levels.
+ */
+static void rx_frame (struct uart *ua, uint64_t now)
+{
+  struct univ_hdr *h = ua->univ->hdr;
+  int64_t dt, dev;
+
+  dt = now - h->rx_time;
+  if (ua->last && (dt < 1000000000)) {
+    // Consecutive frames: track the period and how much it varies,
+    // as bw_dmx does.
+    if (!h->rx_period) h->rx_period = dt;
+    dev = dt - h->rx_period;
+    if (dev < 0) dev = -dev;
+    h->rx_period += (dt - (int64_t) h->rx_period) / 8;
+    h->rx_jitter += (dev - (int64_t) h->rx_jitter) / 8;
+    if (dev > h->rx_jitter_max) h->rx_jitter_max = dev;
+  }
+  ua->last = 1;
+  h->rx_time = now;
+  h->rx_frames++;
+  ua->frames++;
+
+  if (ua->rxbuf[0] != 0) {
+    h->rx_altstart++;
+    h->rx_laststart = ua->rxbuf[0];
+  } else
+    univ_write (ua->univ, 0, ua->rxbuf, ua->n);
+}
+
+
+enum { RX_IDLE, RX_DATA, RX_FULL };
+
+// A break ends the frame before it, and starts the next one.
+static void rx_break (struct uart *ua, uint64_t now)
+{
+  if (ua->state == RX_DATA) {
+    if (ua->n) {
+      rx_frame (ua, now);
+    } else {
+      ua->univ->hdr->rx_errors++;
+      ua->last = 0;
+    }
+  }
+  ua->state = RX_DATA;
+  ua->n = 0;
+}
+
+
+/*
+ * Run the bytes that came in through the frame assembler. Reaching
+ * the configured number of channels also completes a frame: that
+ * saves waiting for the next break.
+ */
+static void rx_bytes (struct uart *ua, unsigned char *buf, int len, uint64_t now)
+{
+  int i, c;
+
+  for (i=0;i<len;i++) {
+    c = buf[i];
+    if (ua->esc == 1) {
+      ua->esc = 0;
+      if (c == 0x00) {
+        ua->esc = 2;
+        continue;
+      }
+      // 0xff 0xff: a 0xff in the data.
+    } else if (ua->esc == 2) {
+      ua->esc = 0;
+      if (c == 0x00) {
+        rx_break (ua, now);
+      } else {
+        // Framing error: drop the frame, wait for the next break.
+        ua->univ->hdr->rx_errors++;
+        ua->last = 0;
+        ua->state = RX_IDLE;
+      }
+      continue;
+    } else if (c == 0xff) {
+      ua->esc = 1;
+      continue;
+    }
+
+    if (ua->state != RX_DATA) continue;
+    ua->rxbuf[ua->n++] = c;
+    if (ua->n == 1 + ua->cfg.datalen) {
+      rx_frame (ua, now);
+      ua->state = RX_FULL;
+    }
+  }
+}
+
+
+static void print_stats (struct uart *ua, char *eol)
+{
+  struct univ_hdr *h = ua->univ->hdr;
+
+  if (rxmode) {
+    fprintf (stderr, "%s: %u frames, %d/s, %u errors, jitter %u/%u us.%s",
+             ua->device, h->rx_frames, ua->frames, h->rx_errors,
+             h->rx_jitter / 1000, h->rx_jitter_max / 1000, eol);
+    ua->frames = 0;
+    return;
+  }
+  if (!ua->frames) return;
+  fprintf (stderr, "%s: %u frames, %d/s, %llu us/frame, late %llu/%llu us, "
+           "%u overruns, %u dropped.%s",
+           ua->device, h->tx_frames, ua->frames,
+           (unsigned long long) ua->busy / ua->frames / 1000,
+           (unsigned long long) ua->late / ua->frames / 1000,
+           (unsigned long long) ua->late_max / 1000,
+           h->tx_overruns, h->tx_drops, eol);
+  ua->frames = 0;
+  ua->late = ua->late_max = ua->busy = 0;
+}
+
+
+/*
+ * Receive stays with blocking reads on one UART: the tty layer wakes
+ * a poller for every byte, so epoll would only add system calls.
+ */
+static void do_rx (struct uart *ua)
+{
+  unsigned char buf[0x400];
+  uint64_t now, nextstats;
+  int n;
+
+  ua->state = RX_IDLE;
+  nextstats = univ_time_ns () + 1000000000ULL;
   while (1) {
-    if (ioctl(uartfd, TIOCSBRK, NULL)  < 0) {
-       perror ("TIOCCBRK");
-       exit (1);
+    // Blocks until the first byte: VTIME only runs between bytes.
+    n = read (ua->fd, buf, sizeof (buf));
+    if (n <= 0)
+      pabort (ua->device);
+    now = univ_time_ns ();
+    rx_bytes (ua, buf, n, now);
+
+    if (verbose && (now > nextstats)) {
+      print_stats (ua, "  \r");
+      nextstats = now + 1000000000ULL;
     }
-    usleep (100);
-    if (ioctl(uartfd, TIOCCBRK, NULL)  < 0) {
-       perror ("TIOCSBRK");
-       exit (1);
+  }
+}
+
+
+// What an epoll event is about: a port's fd, a pty master, the timer.
+#define EV_PTY    0x10000
+#define EV_TIMER  0x20000
+
+static void epoll_add (int fd, uint32_t events, uint32_t data)
+{
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.u32 = data;
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    pabort ("epoll_ctl");
+}
+
+
+static void do_tx (void)
+{
+  struct epoll_event evs[2 * MAXPORT + 1];
+  struct itimerspec its;
+  struct uart *ua;
+  uint64_t now, first, nextstats, expired;
+  int tfd, i, n, timeout;
+  uint32_t d;
+  char *eol;
+
+  epfd = epoll_create1 (0);
+  if (epfd < 0)
+    pabort ("epoll_create1");
+  tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (tfd < 0)
+    pabort ("timerfd_create");
+  epoll_add (tfd, EPOLLIN, EV_TIMER);
+  for (i=0;i<numports;i++) {
+    epoll_add (ports[i].fd, 0, i);
+    if (ptytest)
+      epoll_add (ports[i].master, EPOLLIN, EV_PTY | i);
+  }
+
+  // Give everything a moment to get going before the first tick.
+  epoch = univ_time_ns () + 10000000ULL;
+  for (i=0;i<numports;i++)
+    next_frame (&ports[i], 0);
+  nextstats = epoch + 1000000000ULL;
+  // One line per port when there is more than one.
+  eol = (numports > 1) ? "\n" : "  \r";
+
+  memset (&its, 0, sizeof (its));
+  while (1) {
+    // Take every step that is due, then wait for the next one.
+    now = univ_time_ns ();
+    do {
+      first = NEVER;
+      for (i=0;i<numports;i++) {
+        ua = &ports[i];
+        if (ua->due <= now) {
+          tx_step (ua, now);
+          now = univ_time_ns ();
+        }
+        if (ua->due < first) first = ua->due;
+      }
+    } while (first <= now);
+
+    timeout = -1;
+    if (first - now < SPINTIME) {
+      timeout = 0;
+    } else if (first != NEVER) {
+      its.it_value.tv_sec = first / 1000000000ULL;
+      its.it_value.tv_nsec = first % 1000000000ULL;
+      if (timerfd_settime (tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        pabort ("timerfd_settime");
     }
-    usleep (10);
-    if (write (uartfd, data, 0x200) < 0) {
-       perror ("write");
-       exit (1);
+    n = epoll_wait (epfd, evs, 2 * MAXPORT + 1, timeout);
+    if ((n < 0) && (errno != EINTR))
+      pabort ("epoll_wait");
+
+    now = univ_time_ns ();
+    for (i=0;i<n;i++) {
+      d = evs[i].data.u32;
+      if (d == EV_TIMER) {
+        if (read (tfd, &expired, sizeof (expired)) < 0)
+          continue;          // the timer was set again meanwhile
+      } else if (d & EV_PTY) {
+        pty_read (&ports[d & ~EV_PTY], now);
+      } else {
+        tx_write (&ports[d], now);
+      }
     }
-    usleep (rate);
+    if (timeout == 0)
+      wait_until (first);
+
+    if ((verbose || ptytest) && (now > nextstats)) {
+      for (i=0;i<numports;i++) {
+        if (verbose) print_stats (&ports[i], eol);
+        if (ptytest) print_pty_stats (&ports[i], eol);
+      }
+      nextstats += 1000000000ULL;
+    }
+  }
+}
+
+
+int main (int argc, char **argv)
+{
+  uint64_t ft;
+  int i;
+
+  parse_opts (argc, argv);
+  if (numports == 0)
+    add_port ("dmxdata");
+  if (rxmode && ((numports > 1) || ptytest)) {
+    fprintf (stderr, "receive takes one uart, and no -T\n");
+    exit (1);
   }
+
+  for (i=0;i<numports;i++) {
+    open_uart_univ (&ports[i]);
+    if (ptytest) open_pty (&ports[i]);
+    setup_uart (&ports[i]);
+
+    // One clock for all: its period has to fit the longest frame.
+    ft = (dmx_frametime (ports[i].cfg.datalen, ports[i].cfg.breaktime,
+                         ports[i].cfg.mab) + MTBP) * 1000ULL;
+    if (ft > period) period = ft;
+  }
+  if (interval)
+    period = interval * 1000ULL;
+  if (realtime)
+    rt_setup (realtime, cpu);
+  else if (cpu >= 0)
+    rt_pin (cpu);
+
+  if (rxmode)
+    do_rx (&ports[0]);
+  do_tx ();
+  exit (0);
 }
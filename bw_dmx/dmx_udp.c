@@ -1,121 +1,254 @@
-/* client.c */
+/*
+ * dmx_udp.c
+ *
+ * Send universe files out as Art-Net.
+ *
+ * Every interval the universes are checked for changes; the ones that
+ * changed (or have not been sent for a second) get an ArtDmx packet,
+ * and all of these go to the kernel in a single sendmmsg. With -S an
+ * ArtSync follows, so that the nodes switch all universes at once.
+ *
+ * A file given as file=patchfile is first filled in from other
+ * universes according to the patch (see patch.h).
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#define _GNU_SOURCE   // for sendmmsg
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <getopt.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 
+#include "universe.h"
+#include "dmxnet.h"
+#include "patch.h"
+#include "rt.h"
 
-#define BUF_SIZE 0x200
+#define MAXUNIV 256
 
-int main(int argc, char **argv) 
-{
-  struct addrinfo hints;
-  struct addrinfo *result, *rp;
-  int sfd, s;
-  size_t len;
-  char *data;
-  char tdata[0x280];
-  char *dmxdataname;
-  char *port, *host;
-  int infd;
-  int offset = 0;
+// Nodes expect to hear from us now and then, even when nothing changes.
+#define KEEPALIVE 1000000000ULL
 
-  if ((argc > 2) && (strcmp (argv[1], "-o") == 0)) {
-    offset = atoi (argv[2]);
-    argc -= 2;
-    argv += 2;
-  }
+struct net_univ {
+  struct universe *univ;
+  struct patch *patch;               // NULL: send the file as it is
+  int artuniv;                       // Art-Net port address
+  int seq;
+  uint64_t lastsent;
+  struct univ_tracer trace;
+  unsigned char hdr[ARTNET_HDRLEN];
+  unsigned char shadow[UNIV_NSLOTS]; // what we last sent
+};
 
-  if (argc < 2) {
-    fprintf(stderr, "Usage: %s host port \n", argv[0]);
-    exit(EXIT_FAILURE);
-  }
-  host = argv[1];
-  if (argc > 2) port = argv[2];
-  else          port = "6454";
-
-  if (argc > 3) 
-    dmxdataname = argv[3];
-  else 
-    dmxdataname = "dmxdata"; 
-
-  infd = open (dmxdataname, O_RDWR); 
-  if (infd < 0) {
-    perror (dmxdataname);
-    exit (1);
-  }
+static struct net_univ univ[MAXUNIV];
+static int numuniv;
 
-  data = mmap (NULL, 0x201, PROT_READ | PROT_WRITE, MAP_SHARED, infd, 0);
-  if (data == NULL) {
-    perror ("mmap");
-    exit (1);
-  }
-  
-  /* Obtain address(es) matching host/port */
-
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
-  hints.ai_socktype = SOCK_DGRAM; /* Datagram socket */
-  hints.ai_flags = 0;
-  hints.ai_protocol = 0;          /* Any protocol */
-
-  s = getaddrinfo(host, port, &hints, &result);
-  if (s != 0) {
-    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-    exit(EXIT_FAILURE);
-  }
+static int offset = 0;
+static int interval = 10000;
+static int artsync = 0;
+static int firstuniv = 0;
+static int realtime = 0;   // SCHED_FIFO priority, 0: not real-time
+static int cpu = -1;
 
-  /* getaddrinfo() returns a list of address structures.
-     Try each address until we successfully connect(2).
-     If socket(2) (or connect(2)) fails, we (close the socket
-     and) try the next address. */
 
-  for (rp = result; rp != NULL; rp = rp->ai_next) {
-    sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-    if (sfd == -1)
-      continue;
+static void print_usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-oiuSRP] host [port [file[=patch][:universe] ...]]\n", prog);
+  fputs("  -o --offset   skip this many channels\n"
+        "  -i --interval look for changes this often (usec, default 10000)\n"
+        "  -u --universe Art-Net universe of the first file (default 0),\n"
+        "                the others follow unless given with the file\n"
+        "  -S --sync     send ArtSync after each batch\n"
+        "  -R --realtime SCHED_FIFO at priority 50 (or --realtime=prio),\n"
+        "                memory locked (see rt.h); reports how late it\n"
+        "                woke up every 10 seconds\n"
+        "  -P --cpu      run on this cpu only\n", stderr);
+  exit(EXIT_FAILURE);
+}
 
-    if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
-      break;                  /* Success */
+static const struct option lopts[] = {
+  { "offset",    1, 0, 'o' },
+  { "interval",  1, 0, 'i' },
+  { "universe",  1, 0, 'u' },
+  { "sync",      0, 0, 'S' },
+  { "realtime",  2, 0, 'R' },
+  { "cpu",       1, 0, 'P' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
 
-    close(sfd);
-  }
 
-  if (rp == NULL) {               /* No address succeeded */
-    fprintf(stderr, "Could not connect\n");
-    exit(EXIT_FAILURE);
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "+o:i:u:SR::P:", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'o':offset = atoi (optarg);break;
+    case 'i':interval = atoi (optarg);break;
+    case 'u':firstuniv = atoi (optarg);break;
+    case 'S':artsync = 1;break;
+    case 'R':realtime = optarg ? atoi (optarg) : RT_PRIO;break;
+    case 'P':cpu = atoi (optarg);break;
+    default: print_usage (argv[0]);break;
+    }
   }
+  return optind;
+}
 
-  freeaddrinfo(result);           /* No longer needed */
 
-  /* Send remaining command-line arguments as separate
-     datagrams, and read responses from server */
+static void add_univ (char *arg)
+{
+  struct net_univ *nu;
+  char *fname, *p;
 
-#define DMXDATAOFFSET 18
+  if (numuniv >= MAXUNIV) {
+    fprintf (stderr, "%s: too many universes (max %d)\n", arg, MAXUNIV);
+    exit (1);
+  }
+  nu = &univ[numuniv];
+  fname = strdup (arg);
+  nu->artuniv = firstuniv + numuniv;
+  p = strchr (fname, ':');
+  if (p) {
+    *p++ = 0;
+    nu->artuniv = atoi (p);
+  }
+  nu->patch = patch_arg (fname);
+  nu->univ = univ_open (fname);
+  numuniv++;
+}
 
-  int n = 0;
 
+int main(int argc, char **argv)
+{
+  struct mmsghdr msgs[MAXUNIV + 1];
+  struct iovec iov[MAXUNIV + 1][2];
+  unsigned char sync[ARTNET_SYNCLEN];
+  unsigned char frame[UNIV_NSLOTS];
+  struct univ_range r[1];
+  struct net_univ *nu;
+  char *port, *host;
+  uint64_t now, next, nextreport;
+  int sfd, nonoptions, i, n, sent, len, numsending;
+  int sending[MAXUNIV];
+
+  nonoptions = parse_opts(argc, argv);
+  argc -= nonoptions;
+  argv += nonoptions;
+
+  if (argc < 1)
+    print_usage (argv[-nonoptions]);
+  host = argv[0];
+  if (argc > 1) port = argv[1];
+  else          port = ARTNET_PORT;
+
+  if (argc > 2)
+    for (i=2;i<argc;i++)
+      add_univ (argv[i]);
+  else
+    add_univ ("dmxdata");
+
+  // Art-Net wants an even number of channels.
+  len = 0x200 - offset;
+  if ((offset < 0) || (len < 2)) {
+    fprintf (stderr, "bad offset %d\n", offset);
+    exit (1);
+  }
+  // An odd count takes along a byte of the padding after the slots.
+  if (len & 1) len++;
+
+  sfd = dmxnet_open (host, port);
+
+  memset (msgs, 0, sizeof (msgs));
+  for (i=0;i<numuniv;i++) {
+    nu = &univ[i];
+    iov[i][0].iov_base = nu->hdr;
+    iov[i][0].iov_len = ARTNET_HDRLEN;
+    // the data goes out straight from the universe file.
+    iov[i][1].iov_base = nu->univ->data + 1 + offset;
+    iov[i][1].iov_len = len;
+  }
+  artnet_sync (sync);
+  if (realtime)
+    rt_setup (realtime, cpu);
+  else if (cpu >= 0)
+    rt_pin (cpu);
+
+  next = univ_time_ns ();
+  nextreport = next + RT_REPORTINT;
   while (1) {
-    len = 0x200 - offset;
-    if ((n > 100) || memcmp (tdata+DMXDATAOFFSET, data+1+offset, len) != 0) {
-      // the first byte should be zero indicating "DMX transfer". 
-      // The DMX data starts at offset 1. 
-      memcpy (tdata+DMXDATAOFFSET, data+1+offset, len);
-      len += DMXDATAOFFSET;
-      if (write(sfd, tdata, len) != len) {
-	perror ("partial/failed write");
-	exit(EXIT_FAILURE);
+    univ_sleep_until (next);
+    next += interval * 1000ULL;
+    now = univ_time_ns ();
+    if (realtime && (now > nextreport)) {
+      rt_report ("dmx_udp: ", "\n");
+      nextreport += RT_REPORTINT;
+    }
+
+    n = 0;
+    for (i=0;i<numuniv;i++) {
+      nu = &univ[i];
+      if (nu->patch) {
+        patch_apply (nu->patch, frame);
+        univ_write (nu->univ, 0, frame, UNIV_NSLOTS);
       }
-      n = 0;
-    } else {
+      univ_trace_take (nu->univ, &nu->trace);
+      if (!univ_diff (nu->shadow, nu->univ->data, UNIV_NSLOTS, r, 1) &&
+          (now - nu->lastsent < KEEPALIVE))
+        continue;
+      memcpy (nu->shadow, nu->univ->data, UNIV_NSLOTS);
+      // Sequence numbers run from 1 to 255: 0 means "not used".
+      nu->seq = (nu->seq % 255) + 1;
+      artnet_header (nu->hdr, nu->artuniv, nu->seq, len);
+      nu->lastsent = now;
+
+      msgs[n].msg_hdr.msg_iov = iov[i];
+      msgs[n].msg_hdr.msg_iovlen = 2;
+      sending[n++] = i;
+    }
+    if (!n) continue;
+    numsending = n;
+
+    if (artsync) {
+      iov[MAXUNIV][0].iov_base = sync;
+      iov[MAXUNIV][0].iov_len = ARTNET_SYNCLEN;
+      msgs[n].msg_hdr.msg_iov = iov[MAXUNIV];
+      msgs[n].msg_hdr.msg_iovlen = 1;
       n++;
     }
-    usleep (10000);
+
+    for (i=0;i<n;i+=sent) {
+      sent = sendmmsg (sfd, msgs + i, n - i, 0);
+      if (sent <= 0) {
+        // Nobody listening is not a reason to stop.
+        perror ("sendmmsg");
+        break;
+      }
+    }
+
+    // Only what the kernel took has left.
+    now = univ_time_ns ();
+    for (n=0;(n<i) && (n<numsending);n++)
+      univ_trace_ship (univ[sending[n]].univ, &univ[sending[n]].trace,
+                       UNIV_STAGE_UDP, now);
   }
 
   exit(EXIT_SUCCESS);
@@ -0,0 +1,180 @@
+/*
+ * dmxnet.c
+ *
+ * DMX over the network: Art-Net and E1.31 (sACN) packet headers, and
+ * opening the socket to send them.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "dmxnet.h"
+
+
+/*
+ * ArtDmx: "Art-Net", opcode 0x5000 (little endian), protocol version
+ * 14, sequence, physical port, 15 bit port address, data length (big
+ * endian, even).
+ */
+int artnet_header (unsigned char *hdr, int universe, int seq, int nchan)
+{
+  memcpy (hdr, "Art-Net", 8);
+  hdr[8] = 0x00;
+  hdr[9] = 0x50;
+  hdr[10] = 0;
+  hdr[11] = 14;
+  hdr[12] = seq;
+  hdr[13] = 0;
+  hdr[14] = universe;
+  hdr[15] = (universe >> 8) & 0x7f;
+  hdr[16] = nchan >> 8;
+  hdr[17] = nchan;
+  return ARTNET_HDRLEN;
+}
+
+
+// ArtSync: receivers latch the ArtDmx data they have been holding.
+int artnet_sync (unsigned char *pkt)
+{
+  memcpy (pkt, "Art-Net", 8);
+  pkt[8] = 0x00;
+  pkt[9] = 0x52;
+  pkt[10] = 0;
+  pkt[11] = 14;
+  pkt[12] = 0;
+  pkt[13] = 0;
+  return ARTNET_SYNCLEN;
+}
+
+
+static void put16 (unsigned char *p, int v)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+
+static void put32 (unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+
+/*
+ * E1.31 data packet: root layer, framing layer and DMP layer, ending
+ * with the start code. Each layer starts with 0x7 and the number of
+ * bytes from there to the end of the packet.
+ */
+int e131_header (unsigned char *hdr, const unsigned char *cid,
+                 const char *source, int universe, int priority, int seq,
+                 int startcode, int nchan)
+{
+  int len = E131_HDRLEN + nchan;
+
+  memset (hdr, 0, E131_HDRLEN);
+
+  // root layer
+  put16 (hdr + 0, 0x0010);
+  memcpy (hdr + 4, "ASC-E1.17", 9);
+  put16 (hdr + 16, 0x7000 | (len - 16));
+  put32 (hdr + 18, 0x00000004);
+  memcpy (hdr + 22, cid, E131_CIDLEN);
+
+  // framing layer
+  put16 (hdr + 38, 0x7000 | (len - 38));
+  put32 (hdr + 40, 0x00000002);
+  strncpy ((char *) hdr + 44, source, E131_NAMELEN - 1);
+  hdr[108] = priority;
+  hdr[111] = seq;
+  put16 (hdr + 113, universe);
+
+  // DMP layer
+  put16 (hdr + 115, 0x7000 | (len - 115));
+  hdr[117] = 0x02;
+  hdr[118] = 0xa1;
+  put16 (hdr + 121, 0x0001);
+  put16 (hdr + 123, 1 + nchan);
+  hdr[125] = startcode;
+  return E131_HDRLEN;
+}
+
+
+// Universe n is multicast to 239.255.<n/256>.<n%256>.
+void e131_mcast_addr (char *buf, int universe)
+{
+  sprintf (buf, "239.255.%d.%d", (universe >> 8) & 0xff, universe & 0xff);
+}
+
+
+// A sender is identified by a random CID.
+void e131_make_cid (unsigned char *cid)
+{
+  int fd, i;
+
+  fd = open ("/dev/urandom", O_RDONLY);
+  if ((fd < 0) || (read (fd, cid, E131_CIDLEN) != E131_CIDLEN))
+    for (i=0;i<E131_CIDLEN;i++)
+      cid[i] = random ();
+  if (fd >= 0) close (fd);
+}
+
+
+/*
+ * Return a UDP socket connected to host/port. Broadcast addresses
+ * work, and multicast gets a TTL that lets it past a router or two.
+ */
+int dmxnet_open (const char *host, const char *port)
+{
+  struct addrinfo hints;
+  struct addrinfo *result, *rp;
+  int sfd, s, on = 1, ttl = 4;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
+  hints.ai_socktype = SOCK_DGRAM; /* Datagram socket */
+
+  s = getaddrinfo(host, port, &hints, &result);
+  if (s != 0) {
+    fprintf(stderr, "%s: %s\n", host, gai_strerror(s));
+    exit(EXIT_FAILURE);
+  }
+
+  for (rp = result; rp != NULL; rp = rp->ai_next) {
+    sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    if (sfd == -1)
+      continue;
+
+    setsockopt (sfd, SOL_SOCKET, SO_BROADCAST, &on, sizeof (on));
+    if (rp->ai_family == AF_INET)
+      setsockopt (sfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof (ttl));
+
+    if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
+      break;                  /* Success */
+
+    close(sfd);
+  }
+
+  if (rp == NULL) {               /* No address succeeded */
+    fprintf(stderr, "%s: could not connect\n", host);
+    exit(EXIT_FAILURE);
+  }
+
+  freeaddrinfo(result);
+  return sfd;
+}
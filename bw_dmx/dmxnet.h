@@ -0,0 +1,38 @@
+/*
+ * dmxnet.h
+ *
+ * DMX over the network: Art-Net and E1.31 (sACN) packet headers.
+ *
+ * The builders only fill in the header. The channel data goes out
+ * straight from the universe (slots + 1) as a second iovec, so a
+ * frame is never copied to put it on the network.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdint.h>
+
+#define ARTNET_PORT      "6454"
+#define ARTNET_HDRLEN    18
+#define ARTNET_SYNCLEN   14
+
+#define E131_PORT        "5568"
+#define E131_HDRLEN      126          // up to and including the start code
+#define E131_CIDLEN      16
+#define E131_NAMELEN     64
+#define E131_PRIORITY    100
+
+int artnet_header (unsigned char *hdr, int universe, int seq, int nchan);
+int artnet_sync (unsigned char *pkt);
+
+int e131_header (unsigned char *hdr, const unsigned char *cid,
+                 const char *source, int universe, int priority, int seq,
+                 int startcode, int nchan);
+void e131_mcast_addr (char *buf, int universe);
+void e131_make_cid (unsigned char *cid);
+
+int dmxnet_open (const char *host, const char *port);
@@ -0,0 +1,60 @@
+/*
+ * dmxrec.h
+ *
+ * File format of DMX recordings, as written by dmx_record and played
+ * back by dmx_play.
+ *
+ * After the file header come records, each a rec_hdr followed by len
+ * bytes of payload. A key record holds all slots of a universe, a delta
+ * record a list of (start, len, slots) ranges relative to the previous
+ * state of that universe. Every keyint ms all universes get a key
+ * record; the file offsets of these sets are collected in an index
+ * that is written at the end, followed by the trailer.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdint.h>
+
+#define REC_MAGIC      "DMXREC1"
+#define REC_IDXMAGIC   "DMXIDX1"
+#define REC_MAXUNIV    32
+#define REC_NAMELEN    64
+
+enum rec_type { REC_KEY = 1, REC_DELTA };
+
+
+struct rec_filehdr {
+  char magic[8];
+  uint32_t nuniv;
+  uint32_t keyint;                  // ms between key frames
+  uint64_t start;                   // wall clock at start, usec since 1970
+  char names[REC_MAXUNIV][REC_NAMELEN];
+};
+
+struct rec_hdr {
+  uint32_t dt;                      // usec since the previous record
+  uint8_t univ;
+  uint8_t type;
+  uint16_t len;                     // payload bytes that follow
+} __attribute__ ((packed));
+
+struct rec_range {
+  uint16_t start;
+  uint16_t len;                     // followed by len slots
+} __attribute__ ((packed));
+
+struct rec_index {
+  uint64_t t;                       // usec since the start of the recording
+  uint64_t offset;                  // of the key record for universe 0
+};
+
+struct rec_trailer {
+  uint64_t index;                   // file offset of the index
+  uint64_t nindex;
+  char magic[8];
+};
@@ -1,43 +1,256 @@
+/*
+ * mon_dmx.c
+ *
+ * Watch a universe. By default every update prints one line with the
+ * channels that changed, as set_dmx numbers them:
+ *
+ *   12=255 40-43=0,0,10,10 sc=204
+ *
+ * (sc is the start code). -a prints all channels instead, as a CSV
+ * line; -t keeps a table of all channels on the terminal, with the
+ * ones that changed in the last update highlighted; -b writes a
+ * recording as dmx_record would, to stdout, for analysis tools or
+ * dmx_play.
+ *
+ * It sleeps until a writer commits an update (univ_wait), and looks
+ * every -T ms anyway, for writers that don't. -r limits the updates
+ * shown per second: the changes in between are shown together.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <sys/mman.h>
+#include <getopt.h>
+#include <sys/time.h>
+
+#include "universe.h"
+#include "dmxrec.h"
+
+#define MAXRANGES  64
+
+enum { OUT_DELTA, OUT_ALL, OUT_TOP, OUT_BINARY };
+
+static int mode = OUT_DELTA;
+static int rate = 0;                // updates per second, 0: all of them
+static int timeout = 100;           // ms
+
+
+static void pabort(const char *s)
+{
+  perror(s);
+  exit(1);
+}
+
+
+static void print_usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-atbrT] [file]\n", prog);
+  fputs("  -a --all      print all channels on every update\n"
+        "  -t --top      keep a table of all channels on the terminal\n"
+        "  -b --binary   write a recording (dmx_record format) to stdout\n"
+        "  -r --rate     at most this many updates per second\n"
+        "  -T --timeout  look for changes at least this often (ms, default 100)\n", stderr);
+  exit(EXIT_FAILURE);
+}
+
+static const struct option lopts[] = {
+  { "all",       0, 0, 'a' },
+  { "top",       0, 0, 't' },
+  { "binary",    0, 0, 'b' },
+  { "rate",      1, 0, 'r' },
+  { "timeout",   1, 0, 'T' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
+
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "atbr:T:", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'a':mode = OUT_ALL;break;
+    case 't':mode = OUT_TOP;break;
+    case 'b':mode = OUT_BINARY;break;
+    case 'r':rate = atoi (optarg);break;
+    case 'T':timeout = atoi (optarg);break;
+    default: print_usage (argv[0]);break;
+    }
+  }
+  return optind;
+}
+
+
+static void print_delta (unsigned char *data, struct univ_range *r, int n)
+{
+  int i, j, s;
+
+  for (i=0;i<n;i++) {
+    s = r[i].start;
+    if (s == 0) {
+      printf ("sc=%d ", data[0]);
+      if (r[i].len == 1) continue;
+      s = 1;
+    }
+    if (r[i].start + r[i].len - s == 1)
+      printf ("%d=", s - 1);
+    else
+      printf ("%d-%d=", s - 1, r[i].start + r[i].len - 2);
+    for (j=s;j<r[i].start+r[i].len;j++)
+      printf ("%d%s", data[j], (j+1 < r[i].start+r[i].len) ? "," : " ");
+  }
+  printf ("\n");
+}
+
+
+static void print_all (unsigned char *data)
+{
+  int i;
+
+  // The DMX data starts at offset 1.
+  for (i=1;i<UNIV_NSLOTS-1;i++)
+    printf ("%d,", data[i]);
+  printf ("%d\n", data[i]);
+}
+
+
+/*
+ * The table: 32 rows of 16 channels, drawn over the previous one.
+ * What changed since the last one is shown in reverse video.
+ */
+static void print_top (struct universe *u, unsigned char *data,
+                       unsigned char *old, int updates)
+{
+  struct univ_hdr *h = u->hdr;
+  int i, c;
+
+  printf ("\033[H%s  gen %u  writer %u  %d updates/s  start code %d\033[K\n",
+          u->name, h->gen, h->writer, updates, data[0]);
+  for (c=0;c<UNIV_NSLOTS-1;c++) {
+    if (c % 16 == 0) printf ("\n%3d:", c);
+    i = c + 1;
+    if (data[i] != old[i]) printf (" \033[7m%3d\033[m", data[i]);
+    else                   printf (" %3d", data[i]);
+  }
+  printf ("\033[K\n");
+}
+
+
+static uint64_t lastt;
+
+static void put_record (uint64_t t, int type, unsigned char *buf, int len)
+{
+  struct rec_hdr rh;
+
+  rh.dt = t - lastt;
+  rh.univ = 0;
+  rh.type = type;
+  rh.len = len;
+  lastt = t;
+  if ((fwrite (&rh, sizeof (rh), 1, stdout) != 1) ||
+      (fwrite (buf, 1, len, stdout) != len))
+    pabort ("write");
+}
+
+
+static void put_header (struct universe *u, unsigned char *data)
+{
+  struct rec_filehdr fh;
+  struct timeval tv;
+
+  memset (&fh, 0, sizeof (fh));
+  memcpy (fh.magic, REC_MAGIC, sizeof (fh.magic));
+  fh.nuniv = 1;
+  gettimeofday (&tv, NULL);
+  fh.start = tv.tv_sec * 1000000ULL + tv.tv_usec;
+  strncpy (fh.names[0], u->name, REC_NAMELEN-1);
+  if (fwrite (&fh, sizeof (fh), 1, stdout) != 1)
+    pabort ("write");
+  put_record (0, REC_KEY, data, UNIV_NSLOTS);
+}
+
+
+static void put_delta (uint64_t t, unsigned char *data, struct univ_range *r, int n)
+{
+  unsigned char buf[MAXRANGES * sizeof (struct rec_range) + UNIV_NSLOTS];
+  struct rec_range rr;
+  int i, len = 0;
+
+  for (i=0;i<n;i++) {
+    rr.start = r[i].start;
+    rr.len = r[i].len;
+    memcpy (buf + len, &rr, sizeof (rr));
+    len += sizeof (rr);
+    memcpy (buf + len, data + rr.start, rr.len);
+    len += rr.len;
+  }
+  put_record (t, REC_DELTA, buf, len);
+}
+
 
 int main (int argc, char **argv)
 {
-  char *thefile;
-  unsigned char *data, tdata[0x200];
-  int i, infd;
+  struct universe *univ;
+  struct univ_range r[MAXRANGES];
+  unsigned char data[UNIV_NSLOTS], old[UNIV_NSLOTS];
+  uint64_t now, start, next = 0, second;
+  uint32_t gen;
+  int nonoptions, n, updates = 0, shown = 0;
 
-  if (argc > 1) 
-     thefile = argv[1];
-  else
-     thefile = "dmxdata";
+  nonoptions = parse_opts (argc, argv);
+  univ = univ_open ((nonoptions < argc) ? argv[nonoptions] : "dmxdata");
 
-  infd = open (thefile, O_RDWR); 
-  if (infd < 0) {
-     perror (thefile);
-     exit (1);
+  // Everything is compared with what was shown last.
+  gen = univ->hdr->gen;
+  memcpy (old, univ->data, UNIV_NSLOTS);
+  start = second = univ_time_ns ();
+  switch (mode) {
+  case OUT_ALL:    print_all (old);break;
+  case OUT_TOP:    printf ("\033[2J");print_top (univ, old, old, 0);break;
+  case OUT_BINARY: put_header (univ, old);break;
   }
+  fflush (stdout);
 
-  data = mmap (NULL, 0x201, PROT_READ | PROT_WRITE, MAP_SHARED, infd, 0);
-  //  printf ("data=%p.\n", data);
-  //dmxmode = DMX_TX;
   while (1) {
-    if (memcmp (data, tdata, 0x200) != 0) {
-      // the first byte should be zero indicating "DMX transfer". 
-      // The DMX data starts at offset 1. 
-      for (i=1;i<512;i++)
-	printf ("%d,", data[i]);
-      printf ("%d\n", data[i]);
-      fflush (stdout);
-       memcpy (tdata, data, 0x200);
-    } 
-    usleep (10000);
+    gen = univ_wait (univ, gen, timeout);
+    now = univ_time_ns ();
+    if (rate && (now < next)) {
+      univ_sleep_until (next);
+      now = next;
+    }
+    if (now - second >= 1000000000ULL) {
+      shown = updates;
+      updates = 0;
+      second = now;
+    }
+
+    // A copy first: the writers don't stop while we print.
+    memcpy (data, univ->data, UNIV_NSLOTS);
+    n = univ_diff (old, data, UNIV_NSLOTS, r, MAXRANGES);
+    if (!n) continue;
+    updates++;
+
+    switch (mode) {
+    case OUT_DELTA:  print_delta (data, r, n);break;
+    case OUT_ALL:    print_all (data);break;
+    case OUT_TOP:    print_top (univ, data, old, shown);break;
+    case OUT_BINARY: put_delta ((now - start) / 1000, data, r, n);break;
+    }
+    fflush (stdout);
+    memcpy (old, data, UNIV_NSLOTS);
+    if (rate) next = now + 1000000000ULL / rate;
   }
   exit (0);
 }
@@ -0,0 +1,327 @@
+/*
+ * patch.c
+ *
+ * Load a patch file, compile it into flat tables, and apply it to
+ * produce an output frame. See patch.h for the file format.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "universe.h"
+#include "patch.h"
+
+#define NCHAN (UNIV_NSLOTS - 1)
+
+typedef unsigned char v16u8 __attribute__ ((vector_size (16)));
+typedef unsigned short v8u16 __attribute__ ((vector_size (16)));
+
+// Unpatched channels read a zero through a table of zeroes.
+static unsigned char zero[256];
+
+
+static void patch_error (struct patch *p, int line, char *msg)
+{
+  fprintf (stderr, "%s:%d: %s\n", p->name, line, msg);
+  exit (1);
+}
+
+
+static struct universe *find_src (struct patch *p, char *fname, int line)
+{
+  int i;
+
+  for (i=0;i<p->nsrc;i++)
+    if (strcmp (p->src[i]->name, fname) == 0)
+      return p->src[i];
+  if (p->nsrc >= PATCH_MAXSRC)
+    patch_error (p, line, "too many source universes");
+  p->src[p->nsrc] = univ_open (fname);
+  return p->src[p->nsrc++];
+}
+
+
+// "file:channel": returns a pointer to the slot of that channel.
+static unsigned char *parse_src (struct patch *p, char *s, int line, int *maxlen)
+{
+  struct universe *u;
+  char *c;
+  int chan;
+
+  c = strrchr (s, ':');
+  if (!c)
+    patch_error (p, line, "source should be file:channel");
+  *c++ = 0;
+  chan = atoi (c);
+  if ((chan < 0) || (chan >= NCHAN))
+    patch_error (p, line, "bad source channel");
+  u = find_src (p, s, line);
+  *maxlen = NCHAN - chan;
+  return u->data + 1 + chan;
+}
+
+
+static void make_base (struct patch_curve *c)
+{
+  double x;
+  int v;
+
+  for (v=0;v<256;v++) {
+    x = v / 255.0;
+    if (c->invert) x = 1 - x;
+    if (c->gamma != 1.0) x = pow (x, c->gamma);
+    c->base[v] = c->min + x * (c->max - c->min) + 0.5;
+  }
+  c->plain = (c->gamma == 1.0) && (c->min == 0) && (c->max == 255) && !c->invert;
+}
+
+
+// Channels with the same curve share one table.
+static unsigned char *find_curve (struct patch *p, struct patch_curve *c, int line)
+{
+  struct patch_curve *pc;
+  int i;
+
+  for (i=0;i<p->ncurve;i++) {
+    pc = &p->curve[i];
+    if ((pc->gamma == c->gamma) && (pc->min == c->min) &&
+        (pc->max == c->max) && (pc->invert == c->invert))
+      return pc->lut;
+  }
+  if (p->ncurve >= PATCH_MAXCURVE)
+    patch_error (p, line, "too many different curves");
+  pc = &p->curve[p->ncurve++];
+  *pc = *c;
+  make_base (pc);
+  return pc->lut;
+}
+
+
+static void parse_curve (struct patch *p, struct patch_curve *c, int line)
+{
+  char *t, *v;
+
+  c->gamma = 1.0;
+  c->min = 0;
+  c->max = 255;
+  c->invert = 0;
+  while ((t = strtok (NULL, " \t\n"))) {
+    if (strcmp (t, "invert") == 0) {
+      c->invert = 1;
+      continue;
+    }
+    v = strtok (NULL, " \t\n");
+    if (!v)
+      patch_error (p, line, "curve parameter without a value");
+    if      (strcmp (t, "gamma") == 0) c->gamma = atof (v);
+    else if (strcmp (t, "min") == 0)   c->min = atoi (v);
+    else if ((strcmp (t, "max") == 0) || (strcmp (t, "limit") == 0))
+      c->max = atoi (v);
+    else
+      patch_error (p, line, "unknown curve parameter");
+  }
+  if ((c->gamma <= 0) || (c->min < 0) || (c->max > 255) || (c->min > c->max))
+    patch_error (p, line, "bad curve");
+}
+
+
+static void set_master (struct patch *p, char *s, int line)
+{
+  int dummy;
+
+  if (strchr (s, ':')) {
+    p->masterp = parse_src (p, s, line, &dummy);
+  } else {
+    p->fixed_master = atoi (s);
+    p->masterp = &p->fixed_master;
+  }
+}
+
+
+/*
+ * Sort the output channels into blocks of 16, for patch_apply: runs
+ * from consecutive source slots through one curve, blocks that are
+ * not patched at all, and the rest.
+ */
+static void compile_blocks (struct patch *p)
+{
+  int k, i, j, n;
+
+  for (k=0;k<PATCH_NBLOCK;k++) {
+    i = 1 + k * PATCH_BLOCK;
+    p->block[k] = PATCH_GATHER;
+    for (j=1;j<PATCH_BLOCK;j++)
+      if ((p->from[i+j] != p->from[i] + j) || (p->lut[i+j] != p->lut[i]))
+        break;
+    if (j == PATCH_BLOCK) {
+      for (n=0;n<p->ncurve;n++)
+        if (p->curve[n].lut == p->lut[i]) {
+          p->block[k] = PATCH_RUN;
+          p->blockcurve[k] = &p->curve[n];
+        }
+      continue;
+    }
+    for (j=0;j<PATCH_BLOCK;j++)
+      if (p->lut[i+j] != zero)
+        break;
+    if (j == PATCH_BLOCK)
+      p->block[k] = PATCH_ZERO;
+  }
+}
+
+
+struct patch *patch_load (char *fname)
+{
+  struct patch *p;
+  struct patch_curve c;
+  unsigned char *from, *lut;
+  char buf[0x200], *t, *s;
+  int line, i, a, b, maxlen;
+  FILE *f;
+
+  p = calloc (1, sizeof (*p));
+  if (!p) {
+    perror ("calloc");
+    exit (1);
+  }
+  p->name = strdup (fname);
+  p->fixed_master = 255;
+  p->masterp = &p->fixed_master;
+  p->master = -1;
+  for (i=0;i<UNIV_NSLOTS;i++) {
+    p->from[i] = zero;
+    p->lut[i] = zero;
+  }
+
+  f = fopen (fname, "r");
+  if (!f) {
+    perror (fname);
+    exit (1);
+  }
+  for (line=1;fgets (buf, sizeof (buf), f);line++) {
+    if ((s = strchr (buf, '#'))) *s = 0;
+    t = strtok (buf, " \t\n");
+    if (!t) continue;
+    s = strtok (NULL, " \t\n");
+    if (!s)
+      patch_error (p, line, "missing source");
+    if (strcmp (t, "master") == 0) {
+      set_master (p, s, line);
+      continue;
+    }
+
+    a = b = strtol (t, &t, 0);
+    if (*t == '-') b = strtol (t+1, &t, 0);
+    if (*t || (a < 0) || (b >= NCHAN) || (a > b))
+      patch_error (p, line, "bad output channel");
+    from = parse_src (p, s, line, &maxlen);
+    if (b - a + 1 > maxlen)
+      patch_error (p, line, "range runs past the end of the source");
+    parse_curve (p, &c, line);
+    lut = find_curve (p, &c, line);
+    for (i=a;i<=b;i++) {
+      p->from[i+1] = from + (i - a);
+      p->lut[i+1] = lut;
+    }
+  }
+  fclose (f);
+  compile_blocks (p);
+  return p;
+}
+
+
+/*
+ * A universe argument may name a patch as file=patchfile. Cuts the
+ * patch off the argument and returns it loaded, or NULL if there is
+ * none.
+ */
+struct patch *patch_arg (char *arg)
+{
+  char *p;
+
+  p = strchr (arg, '=');
+  if (!p) return NULL;
+  *p++ = 0;
+  return patch_load (p);
+}
+
+
+/*
+ * (v * m + 127) / 255 for 16 levels at once: what the lut of a plain
+ * curve holds at master m. The even and the odd bytes each go through
+ * 16 bit lanes, and the division by 255 is done with shifts, which is
+ * exact for numbers this small.
+ */
+static v16u8 scale16 (v16u8 v, unsigned short m)
+{
+  v8u16 lo, hi;
+
+  lo = ((v8u16) v & 0xff) * m + 127;
+  hi = ((v8u16) v >> 8) * m + 127;
+  lo = (lo + 1 + (lo >> 8)) >> 8;
+  hi = (hi + 1 + (hi >> 8)) >> 8;
+  return (v16u8) (lo | (hi << 8));
+}
+
+
+/*
+ * Fill out with the start code and all channels. When the master
+ * moved, the curves are rebuilt first: that's 256 entries per curve,
+ * instead of a multiply per channel every frame.
+ *
+ * Runs without a curve are copied, and scaled, 16 channels at a time.
+ * A run through a curve still looks up every channel (a 256 entry
+ * table has no vector form short of SSSE3 or NEON), but from one
+ * source pointer and one table.
+ */
+void patch_apply (struct patch *p, unsigned char *out)
+{
+  struct patch_curve *c;
+  unsigned char *src;
+  v16u8 a;
+  int i, j, k, v, m;
+
+  m = *p->masterp;
+  if (m != p->master) {
+    for (i=0;i<p->ncurve;i++) {
+      c = &p->curve[i];
+      for (v=0;v<256;v++)
+        c->lut[v] = (c->base[v] * m + 127) / 255;
+    }
+    p->master = m;
+  }
+
+  out[0] = 0;
+  for (k=0;k<PATCH_NBLOCK;k++) {
+    i = 1 + k * PATCH_BLOCK;
+    switch (p->block[k]) {
+    case PATCH_ZERO:
+      memset (out + i, 0, PATCH_BLOCK);
+      break;
+    case PATCH_RUN:
+      c = p->blockcurve[k];
+      src = p->from[i];
+      if (c->plain) {
+        memcpy (&a, src, 16);
+        if (m != 255) a = scale16 (a, m);
+        memcpy (out + i, &a, 16);
+      } else {
+        for (j=0;j<PATCH_BLOCK;j++)
+          out[i+j] = c->lut[src[j]];
+      }
+      break;
+    default:
+      for (j=i;j<i+PATCH_BLOCK;j++)
+        out[j] = p->lut[j][*p->from[j]];
+      break;
+    }
+  }
+}
@@ -0,0 +1,76 @@
+/*
+ * patch.h
+ *
+ * Patch: build an output universe from channels of other universe
+ * files, each through a response curve, and all scaled by a grand
+ * master.
+ *
+ * A patch file has lines like
+ *
+ *   # output   source       curve
+ *   0-11       front:0      gamma 2.2
+ *   12         spots:40     limit 200
+ *   13-15      spots:0      invert min 10
+ *   master     desk:511
+ *
+ * Channels are numbered as set_dmx does, 0 is the first one. A range
+ * takes the source channels from the one given on. The curve is any
+ * of "gamma g", "min n", "max n" (or "limit n") and "invert"; without
+ * any, the channel goes through unchanged. "master n" sets a fixed
+ * grand master, "master file:channel" follows a fader in a universe.
+ * Output channels that aren't patched stay at zero.
+ *
+ * All of this is compiled into one table entry per output channel: a
+ * pointer to the source slot and a pointer to a 256 byte lookup table
+ * that already has the master folded in. On top of that, every block
+ * of 16 output channels that comes from 16 consecutive source slots
+ * through one curve is marked as a run: without a curve, a run is one
+ * vector copy, scaled by the master in vector lanes when that's down.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#define PATCH_MAXSRC    32
+#define PATCH_MAXCURVE  64
+#define PATCH_BLOCK     16                              // channels
+#define PATCH_NBLOCK    ((UNIV_NSLOTS - 1) / PATCH_BLOCK)
+
+enum { PATCH_GATHER, PATCH_ZERO, PATCH_RUN };
+
+struct patch_curve {
+  double gamma;
+  int min, max;
+  int invert;
+  int plain;                        // no curve: base[v] == v
+  unsigned char base[256];          // the curve at full master
+  unsigned char lut[256];           // the curve at the current master
+};
+
+struct patch {
+  char *name;
+  int nsrc;
+  struct universe *src[PATCH_MAXSRC];
+  int ncurve;
+  struct patch_curve curve[PATCH_MAXCURVE];
+
+  int master;                       // value the luts were built for
+  unsigned char *masterp;           // the master fader, or fixed_master
+  unsigned char fixed_master;
+
+  // The compiled patch, indexed by output slot.
+  unsigned char *from[UNIV_NSLOTS];
+  unsigned char *lut[UNIV_NSLOTS];
+
+  // Per block of 16 output channels from slot 1 on: PATCH_RUN, with
+  // the curve, PATCH_ZERO when none is patched, else PATCH_GATHER.
+  unsigned char block[PATCH_NBLOCK];
+  struct patch_curve *blockcurve[PATCH_NBLOCK];
+};
+
+struct patch *patch_load (char *fname);
+struct patch *patch_arg (char *arg);
+void patch_apply (struct patch *p, unsigned char *out);
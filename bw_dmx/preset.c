@@ -0,0 +1,219 @@
+/*
+ * preset.c
+ *
+ * Open a preset bank, capture universes into it and recall presets
+ * from it. See preset.h for the layout.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "universe.h"
+#include "preset.h"
+
+#define NCHAN (UNIV_NSLOTS - 1)
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef unsigned char v16u8 __attribute__ ((vector_size (16)));
+
+
+/*
+ * Make an empty bank of PRESET_COUNT presets. It is built under a
+ * temporary name and linked into place when it's complete, so that
+ * nobody opens half a bank. If another process got there first, its
+ * bank is the one.
+ */
+static void create_bank (char *fname)
+{
+  struct preset_hdr hdr;
+  size_t size;
+  char *tmp;
+  int fd;
+
+  tmp = malloc (strlen (fname) + 16);
+  if (!tmp) {
+    perror ("malloc");
+    exit (1);
+  }
+  sprintf (tmp, "%s.%d", fname, getpid ());
+  unlink (tmp);
+  fd = open (tmp, O_RDWR | O_CREAT | O_EXCL, 0666);
+  if (fd < 0) {
+    perror (tmp);
+    exit (1);
+  }
+  memset (&hdr, 0, sizeof (hdr));
+  hdr.magic = PRESET_MAGIC;
+  hdr.version = PRESET_VERSION;
+  hdr.count = PRESET_COUNT;
+  size = PRESET_DATAOFFSET (PRESET_COUNT) + PRESET_COUNT * PRESET_STRIDE;
+  if ((ftruncate (fd, size) < 0) ||
+      (write (fd, &hdr, sizeof (hdr)) != sizeof (hdr))) {
+    perror (tmp);
+    unlink (tmp);
+    exit (1);
+  }
+  close (fd);
+  if ((link (tmp, fname) < 0) && (errno != EEXIST)) {
+    perror (fname);
+    unlink (tmp);
+    exit (1);
+  }
+  unlink (tmp);
+  free (tmp);
+}
+
+
+/*
+ * Map a bank; a file that doesn't exist yet becomes an empty bank of
+ * PRESET_COUNT presets.
+ */
+struct preset_bank *preset_open (char *fname)
+{
+  struct preset_bank *b;
+  struct stat statb;
+  size_t size;
+  void *p;
+  int fd;
+
+  b = calloc (1, sizeof (*b));
+  if (!b) {
+    perror ("calloc");
+    exit (1);
+  }
+  b->name = strdup (fname);
+  fd = open (fname, O_RDWR);
+  if ((fd < 0) && (errno == ENOENT)) {
+    create_bank (fname);
+    fd = open (fname, O_RDWR);
+  }
+  if ((fd < 0) || (fstat (fd, &statb) < 0)) {
+    perror (fname);
+    exit (1);
+  }
+  if (statb.st_size < sizeof (struct preset_hdr)) {
+    fprintf (stderr, "%s: not a preset bank\n", fname);
+    exit (1);
+  }
+  size = statb.st_size;
+
+  p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    perror ("mmap");
+    exit (1);
+  }
+  close (fd);
+  b->hdr = p;
+
+  if ((b->hdr->magic != PRESET_MAGIC) ||
+      (PRESET_DATAOFFSET (b->hdr->count) + b->hdr->count * PRESET_STRIDE > size)) {
+    fprintf (stderr, "%s: not a preset bank\n", fname);
+    exit (1);
+  }
+  b->data = (unsigned char *) p + PRESET_DATAOFFSET (b->hdr->count);
+  return b;
+}
+
+
+int preset_capture (struct preset_bank *b, int n, struct universe *u, char *name)
+{
+  struct preset_entry *e;
+  struct timeval tv;
+
+  if ((n < 0) || (n >= b->hdr->count))
+    return -1;
+  e = &b->hdr->index[n];
+  memcpy (b->data + n * PRESET_STRIDE, u->data, UNIV_NSLOTS);
+  gettimeofday (&tv, NULL);
+  e->time = tv.tv_sec * 1000000ULL + tv.tv_usec;
+  e->gen = u->hdr->gen;
+  memset (e->name, 0, PRESET_NAMELEN);
+  if (name) strncpy (e->name, name, PRESET_NAMELEN - 1);
+  e->used = 1;
+  return 0;
+}
+
+
+// Copy the slots that differ into u, and mark them.
+static void copy_changed (struct universe *u, unsigned char *slots)
+{
+  struct univ_range r[UNIV_NSLOTS / 2 + 1];
+  int i, n;
+
+  n = univ_diff (u->data, slots, UNIV_NSLOTS, r, ARRAY_SIZE (r));
+  for (i=0;i<n;i++) {
+    memcpy (u->data + r[i].start, slots + r[i].start, r[i].len);
+    univ_mark (u, r[i].start, r[i].len);
+  }
+}
+
+
+/*
+ * Recall preset n into u: all of it, or only the slots where mask is
+ * 0xff (as preset_mask makes them). Masked recalls are blended 16
+ * slots at a time. Like univ_mark, this leaves the commit to the
+ * caller, so a recall can be part of a larger update.
+ */
+int preset_recall (struct preset_bank *b, int n, struct universe *u,
+                   unsigned char *mask)
+{
+  unsigned char frame[UNIV_NSLOTS], *p;
+  v16u8 a, c, m;
+  int i;
+
+  if ((n < 0) || (n >= b->hdr->count) || !b->hdr->index[n].used)
+    return -1;
+  p = b->data + n * PRESET_STRIDE;
+  if (!mask) {
+    copy_changed (u, p);
+    return 0;
+  }
+
+  for (i=0;i+16<=UNIV_NSLOTS;i+=16) {
+    memcpy (&a, p + i, 16);
+    memcpy (&c, u->data + i, 16);
+    memcpy (&m, mask + i, 16);
+    a = (a & m) | (c & ~m);
+    memcpy (frame + i, &a, 16);
+  }
+  for (;i<UNIV_NSLOTS;i++)
+    frame[i] = mask[i] ? p[i] : u->data[i];
+  copy_changed (u, frame);
+  return 0;
+}
+
+
+/*
+ * "a-b,c,..." in channels as set_dmx numbers them, to a mask for
+ * preset_recall. Returns -1 if the ranges don't make sense.
+ */
+int preset_mask (char *ranges, unsigned char *mask)
+{
+  char *s = ranges;
+  int a, b;
+
+  memset (mask, 0, UNIV_NSLOTS);
+  while (1) {
+    a = b = strtol (s, &s, 0);
+    if (*s == '-') b = strtol (s+1, &s, 0);
+    if ((a < 0) || (b >= NCHAN) || (a > b))
+      return -1;
+    memset (mask + 1 + a, 0xff, b - a + 1);
+    if (*s == 0) return 0;
+    if (*s++ != ',') return -1;
+  }
+}
@@ -0,0 +1,59 @@
+/*
+ * preset.h
+ *
+ * Preset bank: a file with thousands of universe snapshots, mapped
+ * into every tool that uses it, so that a look can be captured from a
+ * universe or recalled into one in microseconds.
+ *
+ * The file starts with a header and an index with an entry per
+ * preset; the slots follow from PRESET_DATAOFFSET, PRESET_STRIDE
+ * apart. A recall copies the channels that differ into the universe
+ * and marks them; one univ_commit after it makes it one generation
+ * bump. A mask (one byte per slot, 0xff: take it from the preset)
+ * recalls only some channels.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdint.h>
+
+#define PRESET_MAGIC      0x444d5850
+#define PRESET_VERSION    1
+#define PRESET_COUNT      4096          // in a new bank
+#define PRESET_NAMELEN    24
+#define PRESET_STRIDE     0x210         // the slots, rounded up to 16
+
+struct preset_entry {
+  uint32_t used;
+  uint32_t gen;                     // of the universe when captured
+  uint64_t time;                    // wall clock, usec since 1970
+  char name[PRESET_NAMELEN];
+};
+
+struct preset_hdr {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t pad;
+  struct preset_entry index[];
+};
+
+// Where the slots of the presets start in a bank of count presets.
+#define PRESET_DATAOFFSET(count) \
+  ((sizeof (struct preset_hdr) + (count) * sizeof (struct preset_entry) + 0xfff) & ~0xfff)
+
+struct preset_bank {
+  char *name;
+  struct preset_hdr *hdr;
+  unsigned char *data;              // the slots of preset 0
+};
+
+struct preset_bank *preset_open (char *fname);
+int preset_capture (struct preset_bank *b, int n, struct universe *u, char *name);
+int preset_recall (struct preset_bank *b, int n, struct universe *u,
+                   unsigned char *mask);
+int preset_mask (char *ranges, unsigned char *mask);
@@ -0,0 +1,95 @@
+/*
+ * rt.c
+ *
+ * Put an output loop in real-time mode, and report how late it wakes
+ * up. See rt.h.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#define _GNU_SOURCE   // for sched_setaffinity
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "universe.h"
+#include "rt.h"
+
+
+static void rt_warn (const char *what)
+{
+  fprintf (stderr, "realtime: %s: %s, going on without\n", what, strerror (errno));
+}
+
+
+static void __attribute__ ((noinline)) prefault_stack (void)
+{
+  unsigned char buf[RT_STACK];
+
+  memset (buf, 0, sizeof (buf));
+  // Don't let the compiler decide the memset is useless.
+  __asm__ __volatile__ ("" : : "r" (buf) : "memory");
+}
+
+
+// Run on cpu only. Returns -1 if that can't be done.
+int rt_pin (int cpu)
+{
+  cpu_set_t cpus;
+
+  CPU_ZERO (&cpus);
+  CPU_SET (cpu, &cpus);
+  if (sched_setaffinity (0, sizeof (cpus), &cpus) < 0) {
+    rt_warn ("pinning to the cpu");
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+ * SCHED_FIFO at prio, memory locked, and with cpu >= 0 pinned to that
+ * cpu. Returns how many of these didn't work out.
+ */
+int rt_setup (int prio, int cpu)
+{
+  struct sched_param sp;
+  int failed = 0;
+
+  if ((cpu >= 0) && (rt_pin (cpu) < 0))
+    failed++;
+
+  // This faults in everything that is mapped now, universes included.
+  if (mlockall (MCL_CURRENT | MCL_FUTURE) < 0) {
+    rt_warn ("mlockall");
+    failed++;
+  } else {
+    prefault_stack ();
+  }
+
+  memset (&sp, 0, sizeof (sp));
+  sp.sched_priority = prio;
+  if (sched_setscheduler (0, SCHED_FIFO, &sp) < 0) {
+    rt_warn ("SCHED_FIFO");
+    failed++;
+  }
+  return failed;
+}
+
+
+// Mean and worst lateness of this thread's wakeups since the last time.
+void rt_report (const char *prefix, const char *eol)
+{
+  uint64_t mean, max;
+
+  if (!univ_wake_stats (&mean, &max)) return;
+  fprintf (stderr, "%swoke up late %llu/%llu us.%s", prefix,
+           (unsigned long long) mean / 1000, (unsigned long long) max / 1000, eol);
+}
@@ -0,0 +1,37 @@
+/*
+ * rt.h
+ *
+ * Real-time mode for the output loops (--realtime): a SCHED_FIFO
+ * priority so that a backup or a compile can't push a frame out, all
+ * memory locked and faulted in so that touching a universe or the
+ * stack never waits for the disk, and optionally the process pinned
+ * to one core.
+ *
+ * Call rt_setup once the universes are open: their mappings are
+ * faulted in then. Threads created afterwards inherit all of it;
+ * give them stacks of RT_STACK.
+ * Without the privileges (root, or CAP_SYS_NICE and a memlock limit)
+ * every step that fails is reported, and the program runs on without
+ * it.
+ *
+ * How late univ_sleep_until woke up shows how well it works:
+ * rt_report prints that for the calling thread.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#define RT_PRIO       50            // when --realtime doesn't say
+#define RT_REPORTINT  10000000000ULL // ns between reports of the daemons
+
+// Stack the loops may use: rt_setup faults in this much of it, and
+// threads get this much instead of the 8 MB default, which would have
+// to fit in the memlock limit with everything else.
+#define RT_STACK      (256 * 1024)
+
+int rt_setup (int prio, int cpu);
+int rt_pin (int cpu);
+void rt_report (const char *prefix, const char *eol);
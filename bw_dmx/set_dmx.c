@@ -1,50 +1,186 @@
+/*
+ * set_dmx.c
+ *
+ * Set channels of a universe:
+ *
+ *   set_dmx [-f file] start[-end] value ...
+ *
+ * sets channel start, and the ones after it, to the values; with a
+ * range every value is repeated over the range. Channels are numbered
+ * from 0.
+ *
+ * Without channels on the command line, the same commands are read
+ * from stdin, one per line, so a script can send a whole cue list
+ * through one process. Every line is one update: one generation bump
+ * for the lot. With -B the update ends at an empty line (or the end
+ * of the input) instead, to change several ranges at once.
+ *
+ * Presets from a bank (-p, default "presets") can be used the same
+ * way, on the command line or on stdin:
+ *
+ *   capture N [name]         store the universe as preset N
+ *   recall N [a-b,c,...]     recall preset N, or only these channels
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/mman.h>
+#include <getopt.h>
 
-char *open_dmx (char *fname)
+#include "universe.h"
+#include "preset.h"
+
+#define MAXARGS  (UNIV_NSLOTS + 1)
+
+static char *thefile = "dmxdata";
+static char *bankname = "presets";
+static struct preset_bank *bank;
+static int batch = 0;
+
+
+static void print_usage(const char *prog)
 {
-  int infd; 
-  char *data;
+  fprintf(stderr, "Usage: %s [-fpB] [start[-end] value ... | capture N [name] |\n"
+          "                        recall N [channels]]\n", prog);
+  fputs("  -f --file     universe to set (default dmxdata)\n"
+        "  -p --presets  preset bank (default presets)\n"
+        "  -B --batch    with commands on stdin: update at empty lines only\n", stderr);
+  exit(EXIT_FAILURE);
+}
+
+static const struct option lopts[] = {
+  { "file",      1, 0, 'f' },
+  { "presets",   1, 0, 'p' },
+  { "batch",     0, 0, 'B' },
+  { "help",      0, 0, '?' },
+  { NULL, 0, 0, 0 },
+};
 
-  infd = open (fname, O_RDWR); 
-  if (infd < 0) {
-    perror (fname);
-    exit (1);
+
+static int parse_opts(int argc, char *argv[])
+{
+  int c;
+
+  while (1) {
+    c = getopt_long(argc, argv, "f:p:B", lopts, NULL);
+    if (c == -1)
+      break;
+
+    switch (c) {
+    case 'f':thefile = optarg;break;
+    case 'p':bankname = optarg;break;
+    case 'B':batch = 1;break;
+    default: print_usage (argv[0]);break;
+    }
   }
+  return optind;
+}
+
+
+/*
+ * Apply "start[-end] value ..." to the universe, and mark what
+ * changed. Returns -1 if the command doesn't make sense; nothing is
+ * changed then.
+ */
+static int set_channels (struct universe *univ, int argc, char **argv)
+{
+  char *p;
+  int start, end, nn, d, i, j;
+
+  if (argc < 2) return -1;
+  start = end = strtol (argv[0], &p, 0);
+  if (*p == '-') end = strtol (p+1, &p, 0);
+  nn = end - start + 1;
+  if (*p || (start < 0) || (nn < 1) ||
+      (start + 1 + nn * (argc - 1) > UNIV_NSLOTS))
+    return -1;
 
-  data = mmap (NULL, 0x201, PROT_READ | PROT_WRITE, MAP_SHARED, infd, 0);
-  if (data == NULL) {
-    perror ("mmap");
-    exit (1);
+  d = start + 1;
+  for (i=1;i<argc;i++)
+    for (j=0;j<nn;j++)
+      univ->data[d++] = atoi (argv[i]);
+  univ_mark (univ, start + 1, d - (start + 1));
+  return 0;
+}
+
+
+/*
+ * A command: channels and values, or a preset to capture or recall.
+ * The bank is only opened when it's needed.
+ */
+static int do_command (struct universe *univ, int argc, char **argv)
+{
+  static unsigned char mask[UNIV_NSLOTS];
+  int n;
+
+  if ((strcmp (argv[0], "capture") != 0) && (strcmp (argv[0], "recall") != 0))
+    return set_channels (univ, argc, argv);
+
+  if ((argc < 2) || (argc > 3))
+    return -1;
+  if (!bank) bank = preset_open (bankname);
+  n = atoi (argv[1]);
+  if (argv[0][0] == 'c')
+    return preset_capture (bank, n, univ, (argc == 3) ? argv[2] : NULL);
+  if ((argc == 3) && (preset_mask (argv[2], mask) < 0))
+    return -1;
+  return preset_recall (bank, n, univ, (argc == 3) ? mask : NULL);
+}
+
+
+static void read_commands (struct universe *univ)
+{
+  char line[0x1000], *argv[MAXARGS];
+  int argc, lineno, pending = 0;
+
+  for (lineno=1;fgets (line, sizeof (line), stdin);lineno++) {
+    for (argc=0;argc<MAXARGS;argc++)
+      if (!(argv[argc] = strtok (argc ? NULL : line, " \t\r\n")))
+        break;
+    if ((argc == 0) || (argv[0][0] == '#')) {
+      // An empty line ends a batch.
+      if (pending && (argc == 0)) {
+        univ_commit (univ);
+        pending = 0;
+      }
+      continue;
+    }
+    if (do_command (univ, argc, argv) < 0) {
+      fprintf (stderr, "stdin:%d: bad command\n", lineno);
+      continue;
+    }
+    pending = 1;
+    if (!batch) {
+      univ_commit (univ);
+      pending = 0;
+    }
   }
-  return data;
+  if (pending)
+    univ_commit (univ);
 }
 
 
-int main (int argc, char **argv) 
+int main (int argc, char **argv)
 {
-  char *dmxdata;
-  int start;
-  int nn;
-
-  dmxdata = open_dmx ("dmxdata");
-
-  start = atoi (argv[1]); 
-  char *p = strchr (argv[1], '-');
-  if (p) {
-     int end = atoi (p+1);
-     nn = end-start+1;
-  } else 
-     nn = 1;
-  int d = start+1;
-  //printf ("start = %d, nn = %d, d=%d.\n", start, nn, d );
-  for (int i = 2;i< argc;i++) 
-     for (int j = 0;j<nn;j++)
-        dmxdata[d++] = atoi (argv[i]);
+  struct universe *univ;
+  int nonoptions;
+
+  nonoptions = parse_opts (argc, argv);
+  univ = univ_open (thefile);
+
+  if (nonoptions == argc) {
+    read_commands (univ);
+    exit (0);
+  }
+  if (do_command (univ, argc - nonoptions, argv + nonoptions) < 0)
+    print_usage (argv[0]);
+  univ_commit (univ);
   exit (0);
 }
@@ -1,3 +1,23 @@
+/*
+ * set_output.c
+ *
+ * Write raw values into a universe:
+ *
+ *   set_output [-f file] [-o offset] [-s|-b|-w] value ...
+ *
+ * puts the values one after the other from byte offset (default 1,
+ * the first channel) as shorts (the default), bytes or words.
+ *
+ * Without values on the command line, lines of "offset value ..." are
+ * read from stdin, each applied as one update. With -B the update
+ * ends at an empty line (or the end of the input) instead.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
 
 #include <stdint.h>
 #include <unistd.h>
@@ -5,87 +25,144 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/mman.h>
 
+#include "universe.h"
+
+#define MAXARGS  (UNIV_NSLOTS + 1)
 
-static char *thefile = "dmxfile";
+static char *thefile = "dmxdata";
 static int offset = 1;
+static int batch = 0;
 enum dsize_t {DS_SHORT, DS_BYTE, DS_WORD} dsize;
 
 static int dlen[] = {2,1,4};
 
-static void pabort(const char *s)
+
+static void print_usage(const char *prog)
 {
-  perror(s);
-  exit(1);
+  fprintf(stderr, "Usage: %s [-fosbwB] [value ...]\n", prog);
+  fputs("  -f --file     universe to write (default dmxdata)\n"
+        "  -o --offset   byte offset of the first value (default 1)\n"
+        "  -s --short    16 bit values (the default)\n"
+        "  -b --byte     8 bit values\n"
+        "  -w --word     32 bit values\n"
+        "  -B --batch    with \"offset value ...\" lines on stdin: update\n"
+        "                at empty lines only\n", stderr);
+  exit(EXIT_FAILURE);
 }
 
 static const struct option lopts[] = {
-
-  // SPI options. 
   { "file",    1, 0, 'f' },
   { "offset",  1, 0, 'o' },
   { "short",   0, 0, 's' },
   { "byte",    0, 0, 'b' },
   { "word",    0, 0, 'w' },
+  { "batch",   0, 0, 'B' },
+  { "help",    0, 0, '?' },
+  { NULL, 0, 0, 0 },
 };
 
 
 static int parse_opts(int argc, char *argv[])
 {
-  //  int r;
   int c;
 
   while (1) {
-    
-    c = getopt_long(argc, argv, "f:o:sbw", lopts, NULL);
-    
+    c = getopt_long(argc, argv, "f:o:sbwB", lopts, NULL);
     if (c == -1)
       break;
-    
+
     switch (c) {
     case 'f':thefile=strdup (optarg);break;
     case 'o':offset = atoi (optarg);break;
     case 's':dsize = DS_SHORT;break;
     case 'b':dsize = DS_BYTE;break;
     case 'w':dsize = DS_WORD;break;
+    case 'B':batch = 1;break;
+    default: print_usage (argv[0]);break;
     }
   }
   return optind;
 }
 
 
-int main (int argc, char **argv)
+/*
+ * Write the values from byte offset off on, and mark them. The header
+ * is out of bounds. Returns -1, without writing anything, if they
+ * don't fit.
+ */
+static int set_values (struct universe *univ, int off, int argc, char **argv)
 {
-  int nonoptions, i , v, infd;
-  char *data;
+  unsigned char *data = univ->data;
+  int i, v;
 
-  nonoptions = parse_opts(argc, argv);
-  
-  infd = open(thefile, O_RDWR);
-  if (infd < 0)
-    pabort("can't open dxmfile");
-
-  infd = open (thefile, O_RDWR); 
-  if (infd < 0) {
-    perror (thefile);
-    exit (1);
+  if ((off < 0) || (off + argc * dlen[dsize] > UNIV_HDROFFSET))
+    return -1;
+  for (i=0;i<argc;i++) {
+    v = strtol (argv[i], NULL, 0);
+    switch (dsize) {
+    case DS_SHORT:*(uint16_t*)(data+off) = v;break;
+    case DS_BYTE: *( uint8_t*)(data+off) = v;break;
+    case DS_WORD: *(uint32_t*)(data+off) = v;break;
+    }
+    univ_mark (univ, off, dlen [dsize]);
+    off += dlen [dsize];
   }
-  data = mmap (NULL, 0x201, PROT_READ | PROT_WRITE, MAP_SHARED, infd, 0);
+  return 0;
+}
 
-  if (!data) pabort ("mmap");
 
-  for (i=nonoptions;i<argc;i++) {
-    v = strtol (argv[i], NULL, 0);
-    switch (dsize) {
-    case DS_SHORT:*(uint16_t*)(data+offset) = v;break;
-    case DS_BYTE: *( uint8_t*)(data+offset) = v;break;
-    case DS_WORD: *(uint32_t*)(data+offset) = v;break;
+static void read_commands (struct universe *univ)
+{
+  char line[0x1000], *argv[MAXARGS];
+  int argc, lineno, pending = 0;
+
+  for (lineno=1;fgets (line, sizeof (line), stdin);lineno++) {
+    for (argc=0;argc<MAXARGS;argc++)
+      if (!(argv[argc] = strtok (argc ? NULL : line, " \t\r\n")))
+        break;
+    if ((argc == 0) || (argv[0][0] == '#')) {
+      // An empty line ends a batch.
+      if (pending && (argc == 0)) {
+        univ_commit (univ);
+        pending = 0;
+      }
+      continue;
     }
-    offset += dlen [dsize];
+    if ((argc < 2) ||
+        (set_values (univ, strtol (argv[0], NULL, 0), argc - 1, argv + 1) < 0)) {
+      fprintf (stderr, "stdin:%d: bad offset or values\n", lineno);
+      continue;
+    }
+    pending = 1;
+    if (!batch) {
+      univ_commit (univ);
+      pending = 0;
+    }
+  }
+  if (pending)
+    univ_commit (univ);
+}
+
+
+int main (int argc, char **argv)
+{
+  int nonoptions;
+  struct universe *univ;
+
+  nonoptions = parse_opts(argc, argv);
+
+  univ = univ_open (thefile);
+
+  if (nonoptions == argc) {
+    read_commands (univ);
+    exit (0);
+  }
+  if (set_values (univ, offset, argc - nonoptions, argv + nonoptions) < 0) {
+    fprintf (stderr, "values don't fit in the universe\n");
+    exit (1);
   }
+  univ_commit (univ);
 
   exit (0);
 }
@@ -0,0 +1,454 @@
+/*
+ * spi_emu.c
+ *
+ * A BitWizard DMX board on a spidev that isn't there, for benchmarks
+ * of bw_dmx and dmx2ola on a machine without the hardware:
+ *
+ *   LD_PRELOAD=./spi_emu.so bw_dmx -D /dev/spidev0.0 u0 u1 u2 u3
+ *
+ * Opening /dev/spidev... (or what SPI_EMU_DEVICE says) gives a board
+ * instead, and SPI_IOC_MESSAGE on it goes through the board protocol
+ * of dmx.h, with the timing of the real thing:
+ *
+ * - A message takes the time its bytes need at speed_hz on the bus,
+ *   plus SPI_EMU_OVERHEAD usec (default 20) for the driver. Longer
+ *   messages than spidev takes (4096 bytes) fail with EMSGSIZE.
+ * - CMD_DMX_DATA for universe p1 >> 10 starts a frame on that output:
+ *   break, MAB and p2 slots at 250 kbaud. While it is on the line,
+ *   new data is refused with STAT_TX_ACTIVE, as the board does.
+ * - With SPI_EMU_RX=n, every input receives frames of n channels back
+ *   to back at line rate, with a pattern that changes every frame.
+ *   CMD_READ_DMX returns the last complete one (STAT_RXOK, p1 its
+ *   frame counter), or STAT_RX_IN_PROGRESS if that one has been read
+ *   already. Without it, there is no signal: STAT_NODATA. The counter
+ *   runs on past 1024, into the universe bits of p1, as on the board:
+ *   a driver that sends the counter back as p1 asks for the wrong
+ *   input. A READ_DMX with bits below the universe set in p1 gets no
+ *   answer, and is counted as bad.
+ *
+ * What the boards did is reported on stderr at exit, on SIGINT or
+ * SIGTERM, and with SPI_EMU_STATS=n every n seconds: frames per second
+ * per universe, refused frames, bus load and the CPU the program used.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#define _GNU_SOURCE   // for RTLD_NEXT
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include <linux/types.h>
+#include <linux/spi/spidev.h>
+
+#include "dmx.h"
+#include "universe.h"
+
+#define MAXFD     1024
+#define MAXUNIV   16
+#define MAXMSG    4096              // spidev's default bufsiz
+#define NREGS     8                 // the spidev settings, by ioctl number
+
+struct emu_univ {
+  int breaktime, mab, datalen;
+  uint64_t busy;                    // the output frame ends
+  uint32_t lastread;                // rx: the frame last read, + 1
+  uint64_t tx_frames, tx_refused;
+  uint64_t rx_frames, rx_polls, rx_bad;
+};
+
+struct emu_board {
+  char *device;
+  uint32_t regs[NREGS];
+  uint64_t msgs, bytes, bustime;
+  struct emu_univ univ[MAXUNIV];
+};
+
+static struct emu_board *boards[MAXFD];
+
+static int (*real_open) (const char *, int, ...);
+static int (*real_close) (int);
+static int (*real_ioctl) (int, unsigned long, ...);
+
+static const char *prefix = "/dev/spidev";
+static int overhead = 20;           // usec per message
+static int rxchan = 0;              // 0: no input signal
+static uint64_t rxperiod;
+static int statsint = 0;
+static uint64_t start, nextstats;
+
+
+static uint64_t now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void sleep_until (uint64_t t)
+{
+  struct timespec ts;
+
+  ts.tv_sec = t / 1000000000ULL;
+  ts.tv_nsec = t % 1000000000ULL;
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+
+static void report (void)
+{
+  struct emu_board *b;
+  struct emu_univ *eu;
+  struct rusage ru;
+  double secs, cpu;
+  uint64_t frames = 0;
+  int fd, u;
+
+  secs = (now_ns () - start) / 1e9;
+  if (secs <= 0) return;
+  for (fd=0;fd<MAXFD;fd++) {
+    if (!(b = boards[fd])) continue;
+    fprintf (stderr, "spi_emu %s: %llu messages, %.0f kbyte/s, bus %.1f%% busy\n",
+             b->device, (unsigned long long) b->msgs, b->bytes / secs / 1000,
+             b->bustime / secs / 1e7);
+    for (u=0;u<MAXUNIV;u++) {
+      eu = &b->univ[u];
+      if (!eu->tx_frames && !eu->tx_refused && !eu->rx_polls && !eu->rx_bad)
+        continue;
+      if (eu->tx_frames || eu->tx_refused)
+        fprintf (stderr, "  universe %d: %.1f frames/s out, %llu refused\n", u,
+                 eu->tx_frames / secs, (unsigned long long) eu->tx_refused);
+      if (eu->rx_polls)
+        fprintf (stderr, "  universe %d: %.1f frames/s in, %.1f polls/s\n", u,
+                 eu->rx_frames / secs, eu->rx_polls / secs);
+      if (eu->rx_bad)
+        fprintf (stderr, "  universe %d: %llu READ_DMX with stray bits in p1\n",
+                 u, (unsigned long long) eu->rx_bad);
+      frames += eu->tx_frames + eu->rx_frames;
+    }
+  }
+
+  getrusage (RUSAGE_SELF, &ru);
+  cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  fprintf (stderr, "spi_emu: %.1f s, cpu %.1f%%, %.1f us per frame\n",
+           secs, 100 * cpu / secs, frames ? 1e6 * cpu / frames : 0.0);
+}
+
+
+static void report_at_exit (void)
+{
+  report ();
+}
+
+
+static void handle_signal (int sig)
+{
+  report ();
+  signal (sig, SIG_DFL);
+  raise (sig);
+}
+
+
+static int getenv_int (const char *name, int def)
+{
+  char *p = getenv (name);
+
+  return p ? atoi (p) : def;
+}
+
+
+static void __attribute__ ((constructor)) emu_init (void)
+{
+  char *p;
+
+  real_open = dlsym (RTLD_NEXT, "open");
+  real_close = dlsym (RTLD_NEXT, "close");
+  real_ioctl = dlsym (RTLD_NEXT, "ioctl");
+
+  if ((p = getenv ("SPI_EMU_DEVICE"))) prefix = p;
+  overhead = getenv_int ("SPI_EMU_OVERHEAD", overhead);
+  rxchan = getenv_int ("SPI_EMU_RX", 0);
+  if (rxchan > 512) rxchan = 512;
+  if (rxchan > 0)
+    rxperiod = dmx_frametime (rxchan, DMX_BREAK, DMX_MAB) * 1000ULL;
+  statsint = getenv_int ("SPI_EMU_STATS", 0);
+
+  start = now_ns ();
+  nextstats = start + statsint * 1000000000ULL;
+  // The program installs its own handlers after this, if it has any.
+  signal (SIGINT, handle_signal);
+  signal (SIGTERM, handle_signal);
+  atexit (report_at_exit);
+}
+
+
+static int open_board (const char *path)
+{
+  struct emu_board *b;
+  int fd;
+
+  // Something to give the program a file descriptor of its own.
+  fd = real_open ("/dev/null", O_RDWR);
+  if (fd < 0) return fd;
+  if (fd >= MAXFD) {
+    real_close (fd);
+    errno = EMFILE;
+    return -1;
+  }
+  b = calloc (1, sizeof (*b));
+  if (!b) {
+    real_close (fd);
+    errno = ENOMEM;
+    return -1;
+  }
+  b->device = strdup (path);
+  b->regs[_IOC_NR (SPI_IOC_WR_MAX_SPEED_HZ)] = 500000;
+  b->regs[_IOC_NR (SPI_IOC_WR_BITS_PER_WORD)] = 8;
+  boards[fd] = b;
+  return fd;
+}
+
+
+static int is_board (const char *path)
+{
+  return strncmp (path, prefix, strlen (prefix)) == 0;
+}
+
+
+int open (const char *path, int flags, ...)
+{
+  va_list ap;
+  int mode;
+
+  if (is_board (path))
+    return open_board (path);
+  va_start (ap, flags);
+  mode = va_arg (ap, int);
+  va_end (ap);
+  return real_open (path, flags, mode);
+}
+
+
+int open64 (const char *path, int flags, ...)
+{
+  va_list ap;
+  int mode;
+
+  if (is_board (path))
+    return open_board (path);
+  va_start (ap, flags);
+  mode = va_arg (ap, int);
+  va_end (ap);
+  return real_open (path, flags | O_LARGEFILE, mode);
+}
+
+
+int close (int fd)
+{
+  if ((fd >= 0) && (fd < MAXFD) && boards[fd]) {
+    free (boards[fd]->device);
+    free (boards[fd]);
+    boards[fd] = NULL;
+  }
+  return real_close (fd);
+}
+
+
+// Input frame k of universe u: slot i is i + k + 16 u.
+static void rx_pattern (unsigned char *buf, int u, uint32_t k)
+{
+  int i;
+
+  buf[0] = 0;
+  for (i=1;i<=rxchan;i++)
+    buf[i] = i + k + 16 * u;
+}
+
+
+/*
+ * One chip select's worth: the command in the first SPI_HDRLEN bytes
+ * of tx, what the board answers goes to rx (same length, zeroed).
+ */
+static void do_command (struct emu_board *b, unsigned char *tx,
+                        unsigned char *rx, int len, uint64_t now)
+{
+  unsigned char frame[UNIV_NSLOTS];
+  struct spi_hdr cmd, reply;
+  struct emu_univ *eu;
+  uint32_t k;
+  int u, n;
+
+  if (len < SPI_HDRLEN) return;
+  memcpy (&cmd, tx, SPI_HDRLEN);
+  memset (&reply, 0, sizeof (reply));
+  u = cmd.p1 >> 10;
+  eu = (u >= 0 && u < MAXUNIV) ? &b->univ[u] : NULL;
+
+  switch (cmd.cmd) {
+  case CMD_DMXDATA:
+  case CMD_DMX_DATA:
+    if (!eu) break;
+    if (now < eu->busy) {
+      eu->tx_refused++;
+      reply.cmd = STAT_TX_ACTIVE;
+      break;
+    }
+    n = cmd.p2;
+    if (n > len - SPI_HDRLEN) n = len - SPI_HDRLEN;
+    if (n < 1) break;
+    eu->busy = now + 1000ULL * dmx_frametime (n - 1,
+                                  eu->breaktime ? eu->breaktime : DMX_BREAK,
+                                  eu->mab ? eu->mab : DMX_MAB);
+    eu->tx_frames++;
+    reply.cmd = STAT_TX_DONE;
+    break;
+  case CMD_SETBREAK:   if (eu) eu->breaktime = cmd.p2;break;
+  case CMD_SETMAB:     if (eu) eu->mab = cmd.p2;break;
+  case CMD_SETDATALEN: if (eu) eu->datalen = cmd.p2;break;
+  case CMD_IDLE:
+    for (u=0;u<MAXUNIV;u++)
+      b->univ[u].busy = 0;
+    break;
+  case CMD_READ_DMX:
+    if (!eu) break;
+    if (cmd.p1 & 0x3ff) {
+      eu->rx_bad++;
+      break;
+    }
+    eu->rx_polls++;
+    if (!rxperiod) {
+      reply.cmd = STAT_NODATA;
+      break;
+    }
+    k = (now - start) / rxperiod;
+    if (k + 1 == eu->lastread) {
+      reply.cmd = STAT_RX_IN_PROGRESS;
+      reply.p1 = k;
+      break;
+    }
+    eu->lastread = k + 1;
+    eu->rx_frames++;
+    reply.cmd = STAT_RXOK;
+    reply.p1 = k;
+    reply.p2 = 1 + rxchan;
+    n = len - SPI_HDRLEN;
+    if (n > 1 + rxchan) n = 1 + rxchan;
+    if (n > 0) {
+      rx_pattern (frame, u, k);
+      memcpy (rx + SPI_HDRLEN, frame, n);
+    }
+    break;
+  }
+  memcpy (rx, &reply, SPI_HDRLEN);
+}
+
+
+/*
+ * SPI_IOC_MESSAGE: gather the transfers of each chip select into one
+ * buffer, let the board answer once the bytes would have been clocked
+ * out, and scatter the answer over the rx buffers.
+ */
+static int do_message (struct emu_board *b, struct spi_ioc_transfer *tr, int n)
+{
+  unsigned char tx[MAXMSG], rx[MAXMSG];
+  uint64_t t, now, bus = 0;
+  int i, j, first, len, total = 0, off;
+
+  for (i=0;i<n;i++) {
+    total += tr[i].len;
+    t = tr[i].speed_hz ? tr[i].speed_hz : b->regs[_IOC_NR (SPI_IOC_WR_MAX_SPEED_HZ)];
+    if (t) bus += tr[i].len * 8 * 1000000000ULL / t;
+    bus += tr[i].delay_usecs * 1000ULL;
+  }
+  if (total > MAXMSG) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  bus += overhead * 1000ULL;
+  now = now_ns ();
+  sleep_until (now + bus);
+  now += bus;
+  b->msgs++;
+  b->bytes += total;
+  b->bustime += bus;
+
+  for (first=0;first<n;first=i) {
+    // This chip select lasts up to the first transfer with cs_change.
+    len = 0;
+    i = first;
+    while (i < n) {
+      if (tr[i].tx_buf) memcpy (tx + len, (void *) (unsigned long) tr[i].tx_buf, tr[i].len);
+      else              memset (tx + len, 0, tr[i].len);
+      len += tr[i].len;
+      if (tr[i++].cs_change) break;
+    }
+    memset (rx, 0, len);
+    do_command (b, tx, rx, len, now);
+    for (j=first, off=0;j<i;off+=tr[j++].len)
+      if (tr[j].rx_buf)
+        memcpy ((void *) (unsigned long) tr[j].rx_buf, rx + off, tr[j].len);
+  }
+
+  if (statsint && (now > nextstats)) {
+    nextstats += statsint * 1000000000ULL;
+    report ();
+  }
+  return total;
+}
+
+
+int ioctl (int fd, unsigned long req, ...)
+{
+  struct emu_board *b;
+  va_list ap;
+  void *arg;
+  int nr, size;
+
+  va_start (ap, req);
+  arg = va_arg (ap, void *);
+  va_end (ap);
+
+  if ((fd < 0) || (fd >= MAXFD) || !(b = boards[fd]))
+    return real_ioctl (fd, req, arg);
+  if (_IOC_TYPE (req) != SPI_IOC_MAGIC) {
+    errno = ENOTTY;
+    return -1;
+  }
+
+  nr = _IOC_NR (req);
+  size = _IOC_SIZE (req);
+  if (nr == 0)
+    return do_message (b, arg, size / sizeof (struct spi_ioc_transfer));
+
+  // The settings: remember what's written, give it back when read.
+  if ((nr >= NREGS) || (size > sizeof (uint32_t))) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (_IOC_DIR (req) & _IOC_WRITE) {
+    b->regs[nr] = 0;
+    memcpy (&b->regs[nr], arg, size);
+  } else {
+    memcpy (arg, &b->regs[nr], size);
+  }
+  return 0;
+}
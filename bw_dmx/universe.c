@@ -0,0 +1,449 @@
+/*
+ * universe.c
+ *
+ * Access to DMX universe files: mapping them, keeping the header
+ * up-to-date and finding out which channels changed.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "universe.h"
+
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+_Static_assert (UNIV_HDROFFSET + sizeof (struct univ_hdr) <= UNIV_FILESIZE,
+                "the header doesn't fit in the universe file");
+
+typedef unsigned char v16u8 __attribute__ ((vector_size (16)));
+typedef uint64_t v2u64 __attribute__ ((vector_size (16)));
+
+
+char *univ_arena_name (void)
+{
+  char *s;
+
+  s = getenv ("DMX_ARENA");
+  return s ? s : UNIV_ARENA;
+}
+
+
+/*
+ * "@N": universe N of the arena. The whole arena is mapped once, with
+ * one file descriptor that isn't kept, however many universes a tool
+ * opens.
+ */
+static unsigned char *arena;
+static int arena_nuniv;
+
+static void open_arena_univ (struct universe *u, char *fname)
+{
+  struct stat statb;
+  char *name, *e;
+  void *p;
+  int fd, n;
+
+  n = strtol (fname + 1, &e, 0);
+  if (*e || (n < 0)) {
+    fprintf (stderr, "%s: should be @ and a universe number\n", fname);
+    exit (1);
+  }
+  if (!arena) {
+    name = univ_arena_name ();
+    fd = open (name, O_RDWR);
+    if ((fd < 0) || (fstat (fd, &statb) < 0)) {
+      perror (name);
+      fprintf (stderr, "(is dmx_server running?)\n");
+      exit (1);
+    }
+    p = mmap (NULL, statb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      perror ("mmap");
+      exit (1);
+    }
+    close (fd);
+    arena = p;
+    arena_nuniv = statb.st_size / UNIV_FILESIZE;
+  }
+  if (n >= arena_nuniv) {
+    fprintf (stderr, "%s: the arena has %d universes\n", fname, arena_nuniv);
+    exit (1);
+  }
+  u->fd = -1;
+  u->data = arena + n * UNIV_FILESIZE;
+}
+
+
+static void open_file_univ (struct universe *u, char *fname)
+{
+  struct stat statb;
+  void *p;
+
+  u->fd = open (fname, O_RDWR);
+  if (u->fd < 0) {
+    perror (fname);
+    exit (1);
+  }
+
+  // Older files only hold the slots. Grow them to make room for the
+  // header: tools that don't know about it never look there.
+  if (fstat (u->fd, &statb) < 0) {
+    perror (fname);
+    exit (1);
+  }
+  if ((statb.st_size < UNIV_FILESIZE) &&
+      (ftruncate (u->fd, UNIV_FILESIZE) < 0)) {
+    perror (fname);
+    exit (1);
+  }
+
+  p = mmap (NULL, UNIV_FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, 0);
+  if (p == MAP_FAILED) {
+    perror ("mmap");
+    exit (1);
+  }
+  u->data = p;
+}
+
+
+struct universe *univ_open (char *fname)
+{
+  struct universe *u;
+
+  u = calloc (1, sizeof (*u));
+  if (!u) {
+    perror ("calloc");
+    exit (1);
+  }
+  u->name = strdup (fname);
+  if (fname[0] == '@')
+    open_arena_univ (u, fname);
+  else
+    open_file_univ (u, fname);
+
+  u->hdr = (struct univ_hdr *) (u->data + UNIV_HDROFFSET);
+
+  if (u->hdr->magic != UNIV_MAGIC) {
+    memset (u->hdr, 0, sizeof (*u->hdr));
+    u->hdr->version = UNIV_VERSION;
+    __atomic_store_n (&u->hdr->magic, UNIV_MAGIC, __ATOMIC_RELEASE);
+  }
+  return u;
+}
+
+
+/*
+ * Record that slots start .. start+len-1 have been changed. Call
+ * univ_commit when the update is complete.
+ */
+void univ_mark (struct universe *u, int start, int len)
+{
+  int i, end;
+  uint32_t m;
+
+  if (start < 0) {
+    len += start;
+    start = 0;
+  }
+  end = start + len;
+  if (end > UNIV_NSLOTS) end = UNIV_NSLOTS;
+
+  for (i = start; i < end; ) {
+    // Set as many bits as possible in this word at once.
+    if (((i & 31) == 0) && (end - i >= 32)) {
+      m = 0xffffffff;
+      __atomic_fetch_or (&u->hdr->dirty[i >> 5], m, __ATOMIC_RELAXED);
+      i += 32;
+    } else {
+      m = 1u << (i & 31);
+      __atomic_fetch_or (&u->hdr->dirty[i >> 5], m, __ATOMIC_RELAXED);
+      i++;
+    }
+  }
+}
+
+
+void univ_commit (struct universe *u)
+{
+  static pid_t pid;
+  uint32_t gen;
+
+  if (!pid) pid = getpid ();
+  u->hdr->writer = pid;
+  // Stamped before the generation it belongs to is there to be seen.
+  gen = __atomic_load_n (&u->hdr->gen, __ATOMIC_RELAXED) + 1;
+  u->hdr->commit_time[gen % UNIV_COMMITLEN] = univ_time_ns ();
+  __atomic_add_fetch (&u->hdr->gen, 1, __ATOMIC_SEQ_CST);
+  // The system call is only made when someone is waiting.
+  if (__atomic_load_n (&u->hdr->waiters, __ATOMIC_SEQ_CST))
+    syscall (SYS_futex, &u->hdr->gen, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/*
+ * Block until the generation of u differs from gen, or timeout_ms has
+ * passed (-1: no timeout). Returns the generation. Only univ_commit
+ * wakes us: tools that write the slots without it are only seen at
+ * the timeout.
+ */
+uint32_t univ_wait (struct universe *u, uint32_t gen, int timeout_ms)
+{
+  struct timespec ts;
+
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+  __atomic_add_fetch (&u->hdr->waiters, 1, __ATOMIC_SEQ_CST);
+  // The kernel checks gen once more before it sleeps: a commit after
+  // this compare is not missed.
+  if (__atomic_load_n (&u->hdr->gen, __ATOMIC_SEQ_CST) == gen)
+    syscall (SYS_futex, &u->hdr->gen, FUTEX_WAIT, gen,
+             (timeout_ms < 0) ? NULL : &ts, NULL, 0);
+  __atomic_sub_fetch (&u->hdr->waiters, 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n (&u->hdr->gen, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * An output driver is about to read the slots of u for a frame: note
+ * which generation that is, and when the oldest commit in it that we
+ * haven't sent yet was made: that one has waited longest. After more
+ * than UNIV_COMMITLEN commits between two frames it is gone from the
+ * ring, and the oldest one left stands in for it. The first call only
+ * starts the tracing, so an update from before the driver ran doesn't
+ * count.
+ */
+void univ_trace_take (struct universe *u, struct univ_tracer *t)
+{
+  uint32_t first;
+
+  t->gen = __atomic_load_n (&u->hdr->gen, __ATOMIC_ACQUIRE);
+  if (!t->started) {
+    t->started = 1;
+    t->shipped = t->gen;
+  }
+  if (t->gen == t->shipped) return;
+  first = t->shipped + 1;
+  if (t->gen - first >= UNIV_COMMITLEN)
+    first = t->gen - UNIV_COMMITLEN + 1;
+  t->commit = u->hdr->commit_time[first % UNIV_COMMITLEN];
+  t->taken = univ_time_ns ();
+}
+
+
+/*
+ * The frame with the slots from the last univ_trace_take has left at
+ * now. Append a trace to the ring if it carried a new generation.
+ */
+void univ_trace_ship (struct universe *u, struct univ_tracer *t, int stage,
+                      uint64_t now)
+{
+  static pid_t pid;
+  struct univ_trace *tr;
+  uint32_t i;
+
+  if (!t->started || (t->gen == t->shipped)) return;
+  t->shipped = t->gen;
+  if (!pid) pid = getpid ();
+
+  i = __atomic_fetch_add (&u->hdr->trace_head, 1, __ATOMIC_RELAXED);
+  tr = &u->hdr->trace[i % UNIV_TRACELEN];
+  __atomic_store_n (&tr->seq, 0, __ATOMIC_RELAXED);
+  tr->gen = t->gen;
+  tr->stage = stage;
+  tr->pid = pid;
+  tr->commit = t->commit;
+  tr->taken = t->taken;
+  tr->shipped = now;
+  __atomic_store_n (&tr->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Copy len slots from buf into the universe starting at slot
+ * start. Only the slots that actually differ are written and marked
+ * dirty. Returns the number of changed ranges; nothing is committed if
+ * nothing changed.
+ */
+int univ_write (struct universe *u, int start, unsigned char *buf, int len)
+{
+  struct univ_range r[UNIV_NSLOTS / 2 + 1];
+  int i, n;
+
+  if (start < 0 || len <= 0 || start + len > UNIV_NSLOTS)
+    return 0;
+
+  n = univ_diff (u->data + start, buf, len, r, ARRAY_SIZE (r));
+  for (i = 0; i < n; i++) {
+    memcpy (u->data + start + r[i].start, buf + r[i].start, r[i].len);
+    univ_mark (u, start + r[i].start, r[i].len);
+  }
+  if (n) univ_commit (u);
+  return n;
+}
+
+
+/*
+ * Fetch and clear the dirty bitmap. Clearing makes this a
+ * single-consumer interface: normally the output driver for the
+ * universe owns it. Other readers keep a private copy and use
+ * univ_diff. Returns nonzero if any bit was set.
+ */
+int univ_take_dirty (struct universe *u, uint32_t *bits)
+{
+  int i, any = 0;
+
+  for (i = 0; i < UNIV_DIRTYWORDS; i++) {
+    if (u->hdr->dirty[i])
+      bits[i] = __atomic_exchange_n (&u->hdr->dirty[i], 0, __ATOMIC_ACQUIRE);
+    else
+      bits[i] = 0;
+    any |= bits[i] != 0;
+  }
+  return any;
+}
+
+
+static int add_range (struct univ_range *r, int n, int maxr,
+                      int start, int end, int limit)
+{
+  if (n == maxr) {
+    // Out of ranges: let the last one cover everything that's left.
+    r[n-1].len = limit - r[n-1].start;
+    return n;
+  }
+  r[n].start = start;
+  r[n].len = end - start;
+  return n + 1;
+}
+
+
+int univ_bits_to_ranges (uint32_t *bits, struct univ_range *r, int maxr)
+{
+  int i, n = 0, start = -1;
+
+  for (i = 0; i < UNIV_NSLOTS; i++) {
+    if ((i & 31) == 0 && start < 0 && bits[i >> 5] == 0) {
+      i += 31;
+      continue;
+    }
+    if (bits[i >> 5] & (1u << (i & 31))) {
+      if (start < 0) start = i;
+    } else if (start >= 0) {
+      n = add_range (r, n, maxr, start, i, UNIV_NSLOTS);
+      if (n == maxr && r[n-1].start + r[n-1].len == UNIV_NSLOTS) return n;
+      start = -1;
+    }
+  }
+  if (start >= 0)
+    n = add_range (r, n, maxr, start, UNIV_NSLOTS, UNIV_NSLOTS);
+  return n;
+}
+
+
+/*
+ * Compare two frames and list the ranges of slots that differ. The
+ * compare runs 16 bytes at a time (NEON on the pi, SSE on a PC), only
+ * blocks that differ are looked at byte by byte. If there are more
+ * than maxr ranges, the last one is extended to the end.
+ */
+int univ_diff (unsigned char *old, unsigned char *new, int len,
+               struct univ_range *r, int maxr)
+{
+  v16u8 a, b;
+  v2u64 x;
+  int i, j, n = 0, start = -1;
+
+  if (maxr <= 0) return 0;
+
+  for (i = 0; i < len; i += 16) {
+    if (len - i >= 16) {
+      memcpy (&a, old + i, 16);
+      memcpy (&b, new + i, 16);
+      x = (v2u64) (a ^ b);
+      if ((x[0] | x[1]) == 0) {
+        if (start >= 0) {
+          n = add_range (r, n, maxr, start, i, len);
+          start = -1;
+        }
+        continue;
+      }
+    }
+    for (j = i; (j < i + 16) && (j < len); j++) {
+      if (old[j] != new[j]) {
+        if (start < 0) start = j;
+      } else if (start >= 0) {
+        n = add_range (r, n, maxr, start, j, len);
+        start = -1;
+      }
+    }
+    if (n == maxr && r[n-1].start + r[n-1].len == len) return n;
+  }
+  if (start >= 0)
+    n = add_range (r, n, maxr, start, len, len);
+  return n;
+}
+
+
+uint64_t univ_time_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// How late univ_sleep_until returned, per thread, since the last
+// univ_wake_stats.
+static __thread uint64_t wake_n, wake_sum, wake_max;
+
+// Sleep until univ_time_ns () reaches t. Deadlines don't drift the way
+// a usleep after doing some work does. 
+void univ_sleep_until (uint64_t t)
+{
+  struct timespec ts;
+  uint64_t now, late;
+
+  ts.tv_sec = t / 1000000000ULL;
+  ts.tv_nsec = t % 1000000000ULL;
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+
+  now = univ_time_ns ();
+  late = (now > t) ? now - t : 0;
+  wake_n++;
+  wake_sum += late;
+  if (late > wake_max) wake_max = late;
+}
+
+
+/*
+ * The mean and the worst lateness (ns) of the wakeups of this thread
+ * since the last call. Returns how many there were.
+ */
+uint64_t univ_wake_stats (uint64_t *mean, uint64_t *max)
+{
+  uint64_t n = wake_n;
+
+  *mean = n ? wake_sum / n : 0;
+  *max = wake_max;
+  wake_n = wake_sum = wake_max = 0;
+  return n;
+}
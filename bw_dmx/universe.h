@@ -0,0 +1,136 @@
+/*
+ * universe.h
+ *
+ * Layout of a DMX universe file, and the helpers the tools use to
+ * access one.
+ *
+ * A universe file starts with the 513 DMX slots (start code followed
+ * by 512 channels), exactly as the older tools expect: anything that
+ * simply mmaps the first 0x201 bytes keeps working. At UNIV_HDROFFSET
+ * follows a header with bookkeeping that cooperating tools maintain.
+ *
+ * A universe can also live in the arena of dmx_server: one shared
+ * memory file with UNIV_FILESIZE for every universe, laid out the same.
+ * Tools name those "@N" instead of a file. The arena is UNIV_ARENA, or
+ * what DMX_ARENA in the environment says.
+ *
+ * Copyright (c) 2012-2013  Roger Wolff <R.E.Wolff@BitWizard.nl>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ */
+
+#include <stdint.h>
+
+#define UNIV_NSLOTS     0x201   // start code + 512 channels.
+#define UNIV_HDROFFSET  0x400
+#define UNIV_FILESIZE   0x1000
+
+#define UNIV_ARENA      "/dev/shm/dmx_arena"
+
+#define UNIV_MAGIC      0x444d5855
+#define UNIV_VERSION    1
+
+#define UNIV_DIRTYWORDS ((UNIV_NSLOTS + 31) / 32)
+
+#define UNIV_TRACELEN   64
+#define UNIV_COMMITLEN  16
+
+
+/*
+ * Latency tracing. Every commit stamps the universe with its time, in
+ * a small ring indexed by the generation it makes. An output driver
+ * notes, when it takes the slots for a frame (univ_trace_take), the
+ * generation and the time of the first commit it hasn't sent yet; when
+ * that frame has left (univ_trace_ship) it appends a trace to the ring
+ * in the header, once per generation. dmx_latency reads the ring.
+ */
+enum { UNIV_STAGE_SPI = 1, UNIV_STAGE_UART, UNIV_STAGE_UDP, UNIV_STAGE_SACN };
+
+struct univ_trace {
+  uint32_t seq;                     // index in the ring + 1, when complete
+  uint32_t gen;
+  uint32_t stage;                   // UNIV_STAGE_*
+  uint32_t pid;                     // of the output driver
+  uint64_t commit;                  // univ_time_ns () of the oldest commit
+  uint64_t taken;                   // the driver read the slots
+  uint64_t shipped;                 // the last slot went to the hardware
+};
+
+
+struct univ_hdr {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t gen;                     // bumped after every committed update
+  uint32_t dirty[UNIV_DIRTYWORDS];  // one bit per slot, set by writers
+
+  // Maintained by the output driver.
+  uint32_t tx_frames;               // frames accepted by the hardware
+  uint32_t tx_overruns;             // frames refused: previous still busy
+  uint32_t tx_drops;                // frame slots missed by being late
+
+  // Maintained by the receiver.
+  uint64_t rx_time;                 // univ_time_ns () of the last frame
+  uint32_t rx_frames;
+  uint32_t rx_missed;               // frames that came and went unseen
+  uint32_t rx_nodata;               // polls that found no DMX signal
+  uint32_t rx_altstart;             // frames with a non-zero start code
+  uint32_t rx_laststart;            // the last non-zero start code seen
+  uint32_t rx_period;               // ns between frames, averaged
+  uint32_t rx_jitter;               // ns deviation from rx_period, averaged
+  uint32_t rx_jitter_max;
+  uint32_t rx_rejected;             // network: late, duplicate or outranked
+  uint32_t rx_errors;               // uart: framing errors, empty frames
+
+  uint32_t writer;                  // pid of the last process to commit
+  uint32_t waiters;                 // processes blocked in univ_wait
+
+  uint64_t commit_time[UNIV_COMMITLEN]; // of generation g at g % LEN
+  uint32_t trace_head;              // traces written so far
+  struct univ_trace trace[UNIV_TRACELEN];
+};
+
+
+struct universe {
+  char *name;
+  int fd;
+  unsigned char *data;              // data[0] is the start code.
+  struct univ_hdr *hdr;
+};
+
+
+// What an output driver keeps per universe for univ_trace_*.
+struct univ_tracer {
+  int started;
+  uint32_t gen, shipped;            // taken, and last traced generation
+  uint64_t commit, taken;
+};
+
+
+struct univ_range {
+  short start;                      // first changed slot
+  short len;
+};
+
+
+char *univ_arena_name (void);
+struct universe *univ_open (char *fname);
+
+void univ_mark (struct universe *u, int start, int len);
+void univ_commit (struct universe *u);
+uint32_t univ_wait (struct universe *u, uint32_t gen, int timeout_ms);
+int univ_write (struct universe *u, int start, unsigned char *buf, int len);
+
+void univ_trace_take (struct universe *u, struct univ_tracer *t);
+void univ_trace_ship (struct universe *u, struct univ_tracer *t, int stage,
+                      uint64_t now);
+
+int univ_take_dirty (struct universe *u, uint32_t *bits);
+int univ_bits_to_ranges (uint32_t *bits, struct univ_range *r, int maxr);
+int univ_diff (unsigned char *old, unsigned char *new, int len,
+               struct univ_range *r, int maxr);
+
+uint64_t univ_time_ns (void);
+void univ_sleep_until (uint64_t t);
+uint64_t univ_wake_stats (uint64_t *mean, uint64_t *max);